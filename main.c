@@ -1,21 +1,54 @@
 #define PSH_CORE_IMPL
 #define PSH_CORE_NO_PREFIX
     #include "psh_core.h"
+#include <pthread.h>
 
 i32 example_simple_command();
 i32 example_read_cmd_output();
 i32 example_pipeline();
+i32 example_pipeline_file_ends();
+i32 example_graph_tap();
 i32 example_multiple_readers();
 i32 example_redirect_stderr_to_stdout();
 i32 example_use_one_fd_for_multiple_cmds();
+i32 example_bench_spawn();
+i32 example_bench_pipe_size();
+i32 example_bench_hash_map();
+i32 example_bench_hash_map_file();
+i32 example_bench_hash_bytes();
+i32 example_bench_sharded_hash_map();
+i32 example_stress_sharded_hash_map();
+i32 example_bench_arena_pool();
+i32 example_bench_arena_pages();
+i32 example_bench_pool();
+i32 example_bench_arena_list();
+i32 example_bench_seg_list();
+i32 example_bench_file_map();
+i32 example_bench_fd_writer();
 
 i32 main() {
     // example_simple_command();
     // example_read_cmd_output();
     // example_pipeline();
+    // example_pipeline_file_ends();
+    // example_graph_tap();
     // example_multiple_readers();
     // example_redirect_stderr_to_stdout();
     example_use_one_fd_for_multiple_cmds();
+    // example_bench_spawn();
+    // example_bench_pipe_size();
+    // example_bench_hash_map();
+    // example_bench_hash_map_file();
+    // example_bench_hash_bytes();
+    // example_bench_sharded_hash_map();
+    // example_stress_sharded_hash_map();
+    // example_bench_arena_pool();
+    // example_bench_arena_pages();
+    // example_bench_pool();
+    // example_bench_arena_list();
+    // example_bench_seg_list();
+    // example_bench_file_map();
+    // example_bench_fd_writer();
 
     return 0;
 }
@@ -75,6 +108,85 @@ i32 example_pipeline() {
     return 0;
 }
 
+// The first stage reads a file and the last one writes one, which
+// must leave the process's own stdin and stdout open
+i32 example_pipeline_file_ends() {
+    Cmd cmd = {0};
+    Pipeline p = {0};
+
+    pipeline(&p) {
+        cmd_append(&cmd, "cat");
+        pipeline_chain(&p, &cmd, .fdin = fd_openr("main.c"));
+
+        cmd_append(&cmd, "wc", "-l");
+        pipeline_chain(&p, &cmd, .fdout = fd_openw("file.txt"));
+    } if (p.error) return 1;
+
+    if (fcntl(STDIN_FILENO, F_GETFD) < 0 || fcntl(STDOUT_FILENO, F_GETFD) < 0) {
+        logger(PSH_ERROR, "the pipeline closed stdin or stdout");
+        return 1;
+    }
+    printf("stdin and stdout are still open\n");
+
+    cmd_append(&cmd, "rm", "file.txt");
+    if (!cmd_run(&cmd)) return 1;
+
+    return 0;
+}
+
+// Every job taps its stdout into a file. Each link of the chain cats the
+// file of the one before it, so it sees the whole output only if the
+// graph waited for the tap helper too.
+i32 example_graph_tap() {
+    enum { chain_len = 6, free_jobs = 4 };
+    Graph g = {0};
+    Cmd cmd = {0};
+    char path[64];
+    // the commands keep pointers to their arguments until the run
+    char scripts[chain_len][64];
+
+    Job prev = INVALID_JOB;
+    for (i32 i = 0; i < chain_len; ++i) {
+        snprintf(path, sizeof(path), "graph_tap_%d.txt", i);
+        byte *script = scripts[i];
+        if (i == 0) snprintf(script, sizeof(scripts[i]), "echo 0");
+        else snprintf(script, sizeof(scripts[i]), "cat graph_tap_%d.txt; echo %d", i - 1, i);
+
+        cmd_append(&cmd, "sh", "-c", script);
+        Job job = graph_add(&g, &cmd, .fdout = fd_openw("/dev/null"), .tap = fd_openw(path));
+        if (prev != INVALID_JOB) graph_depend(&g, job, prev);
+        prev = job;
+    }
+    for (i32 i = 0; i < free_jobs; ++i) {
+        snprintf(path, sizeof(path), "graph_tap_%d.txt", chain_len + i);
+        cmd_append(&cmd, "echo", "free");
+        graph_add(&g, &cmd, .fdout = fd_openw("/dev/null"), .tap = fd_openw(path));
+    }
+
+    b32 ok = graph_run(&g, .max_procs = 3);
+    for (Job job = 0; job < g.nodes.count; ++job) {
+        if (g.nodes.items[job].state != PSH_JOB_DONE) {
+            logger(PSH_ERROR, "job %zd did not finish", job);
+            ok = false;
+        }
+    }
+
+    snprintf(path, sizeof(path), "graph_tap_%d.txt", chain_len - 1);
+    s8 last = file_map(path);
+    if (last.s == NULL || last.len != 2 * chain_len) {
+        logger(PSH_ERROR, "the chain saw %zd bytes instead of %d", last.len, 2 * chain_len);
+        ok = false;
+    }
+    file_unmap(last);
+    graph_free(&g);
+
+    cmd_append(&cmd, "sh", "-c", "rm -f graph_tap_*.txt");
+    if (!cmd_run(&cmd)) return 1;
+
+    if (ok) printf("every job of the tapped graph finished\n");
+    return !ok;
+}
+
 i32 example_multiple_readers() {
     Unix_Pipe outpipe = {0};
     if (!pipe_open(&outpipe)) return 1;
@@ -175,4 +287,827 @@ i32 example_use_one_fd_for_multiple_cmds() {
     if (!cmd_run(&cmd)) return 1;
 
     return 0;
-}
\ No newline at end of file
+}
+
+// Run with 2>/dev/null to hide the CMD echo
+i32 example_bench_spawn() {
+    // simulate a parent with a large resident set
+    const usize resident = GB(2);
+    byte *memory = malloc(resident);
+    if (memory == NULL) return 1;
+    memset(memory, 1, resident);
+
+    const i32 runs = 10000;
+    Spawn_Backend backends[] = {SPAWN_FORK, SPAWN_POSIX};
+    byte *names[] = {"fork", "posix_spawn"};
+
+    Cmd cmd = {0};
+    for (usize b = 0; b < countof(backends); ++b) {
+        u64 start = time_now_ns();
+        for (i32 i = 0; i < runs; ++i) {
+            cmd_append(&cmd, "true");
+            if (!cmd_run(&cmd, .spawn = backends[b])) return 1;
+        }
+        u64 elapsed = time_now_ns() - start;
+        printf("%-12s %d runs: %.3f s (%.1f us/spawn)\n", names[b], runs,
+               elapsed / 1e9, elapsed / 1e3 / runs);
+    }
+
+    list_free(cmd);
+    free(memory);
+    return 0;
+}
+
+// Run with 2>/dev/null to hide the CMD echo
+i32 example_bench_pipe_size() {
+    static byte *bytes = "1073741824"; // 1 GiB
+    usize sizes[] = {0, KB(256), MB(1), MB(4)};
+
+    Cmd cmd = {0};
+    Procs procs = {0};
+    Pipeline p = {0};
+    for (usize i = 0; i < countof(sizes); ++i) {
+        u64 start = time_now_ns();
+        pipeline(&p, .async = &procs, .max_procs = 8, .pipe_size = sizes[i]) {
+            cmd_append(&cmd, "head", "-c", bytes, "/dev/zero");
+            pipeline_chain(&p, &cmd);
+
+            cmd_append(&cmd, "cat");
+            pipeline_chain(&p, &cmd);
+
+            cmd_append(&cmd, "cat");
+            pipeline_chain(&p, &cmd, .fdout = fd_openw("/dev/null"));
+        } if (p.error) return 1;
+        if (!procs_block(&procs)) return 1;
+
+        f64 seconds = (time_now_ns() - start) / 1e9;
+        printf("pipe size %7zu KiB: %.1f MB/s\n", sizes[i] >> 10, atof(bytes) / 1e6 / seconds);
+    }
+
+    list_free(cmd);
+    procs_free(&procs);
+    return 0;
+}
+
+static u64 bench_u64_hash(u64 key) { return key; }
+static b32 bench_u64_equal(u64 a, u64 b) { return a == b; }
+hash_map_def(u64, u64)
+
+i32 example_bench_hash_map() {
+    usize counts[] = {1000000, 10000000, 100000000};
+
+    for (usize i = 0; i < countof(counts); ++i) {
+        u64 n = counts[i];
+        HashMap(u64, u64) map = {.key_hash = bench_u64_hash, .key_equal = bench_u64_equal};
+        // odd multiplier so keys are scattered but unique
+        u64 mul = UINT64_C(0x9e3779b97f4a7c15);
+
+        u64 start = time_now_ns();
+        for (u64 k = 0; k < n; ++k) hash_map_insert(&map, k * mul, k);
+        u64 insert_ns = time_now_ns() - start;
+
+        u64 sum = 0;
+        start = time_now_ns();
+        for (u64 k = 0; k < n; ++k) {
+            u64 *value;
+            hash_map_get(&map, k * mul, &value);
+            sum += *value;
+        }
+        u64 hit_ns = time_now_ns() - start;
+
+        u64 *keys = malloc(n * sizeof(*keys));
+        u64 **values = malloc(n * sizeof(*values));
+        if (!keys || !values) return 1;
+        for (u64 k = 0; k < n; ++k) keys[k] = k * mul;
+        start = time_now_ns();
+        hash_map_get_many(&map, keys, n, values);
+        for (u64 k = 0; k < n; ++k) sum += *values[k];
+        u64 batch_ns = time_now_ns() - start;
+        free(keys);
+        free(values);
+
+        start = time_now_ns();
+        for (u64 k = n; k < 2 * n; ++k) {
+            u64 *value;
+            hash_map_get(&map, k * mul, &value);
+            sum += value != NULL;
+        }
+        u64 miss_ns = time_now_ns() - start;
+
+        start = time_now_ns();
+        for (u64 k = 0; k < n; k += 2) hash_map_remove(&map, k * mul);
+        u64 remove_ns = time_now_ns() - start;
+
+        printf("%9lu entries: insert %5.1f ns, hit %5.1f ns, batched hit %5.1f ns, miss %5.1f ns, remove %5.1f ns (%lu)\n",
+               n, (f64)insert_ns / n, (f64)hit_ns / n, (f64)batch_ns / n, (f64)miss_ns / n, (f64)remove_ns / (n / 2), sum);
+        hash_map_free(&map);
+    }
+
+    return 0;
+}
+
+#define BENCH_HASH_MAP_FILE_PATH    "bench_hash_map.bin"
+#define BENCH_HASH_MAP_FILE_LOOKUPS 1000
+
+// Writes the file back and drops it from the page cache,
+// so the next open has to read it from disk
+static void bench_evict_file(byte *path) {
+    Fd fd = fd_openr(path);
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    fd_close(fd);
+}
+
+i32 example_bench_hash_map_file() {
+    usize counts[] = {1000000, 10000000};
+
+    for (usize i = 0; i < countof(counts); ++i) {
+        u64 n = counts[i];
+        HashMap(u64, u64) map = {.key_hash = bench_u64_hash, .key_equal = bench_u64_equal};
+        u64 mul = UINT64_C(0x9e3779b97f4a7c15);
+
+        u64 start = time_now_ns();
+        for (u64 k = 0; k < n; ++k) hash_map_insert(&map, k * mul, k);
+        u64 build_ns = time_now_ns() - start;
+
+        start = time_now_ns();
+        if (!hash_map_save(&map, BENCH_HASH_MAP_FILE_PATH)) return 1;
+        u64 save_ns = time_now_ns() - start;
+        hash_map_free(&map);
+        bench_evict_file(BENCH_HASH_MAP_FILE_PATH);
+
+        u64 sum = 0;
+        u64 x = 1;
+        start = time_now_ns();
+        if (!hash_map_open(&map, BENCH_HASH_MAP_FILE_PATH, bench_u64_hash, bench_u64_equal)) return 1;
+        for (usize l = 0; l < BENCH_HASH_MAP_FILE_LOOKUPS; ++l) {
+            x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+            u64 *value;
+            hash_map_get(&map, (x % n) * mul, &value);
+            sum += *value;
+        }
+        u64 open_ns = time_now_ns() - start;
+        hash_map_free(&map);
+
+        printf("%9lu entries: build %7.1f ms, save %7.1f ms, cold open + %d lookups %7.1f ms (%lu)\n",
+               n, build_ns / 1e6, save_ns / 1e6, BENCH_HASH_MAP_FILE_LOOKUPS, open_ns / 1e6, sum);
+    }
+
+    unlink(BENCH_HASH_MAP_FILE_PATH);
+    return 0;
+}
+
+// The previous psh_hash_bytes, kept as a baseline
+static u64 bench_fnv1a(void const *data, usize size) {
+    byte const *bytes = data;
+    u64 hash = UINT64_C(14695981039346656037);
+    for (usize i = 0; i < size; ++i) {
+        hash ^= (u8)bytes[i];
+        hash *= UINT64_C(1099511628211);
+    }
+    return hash;
+}
+
+i32 example_bench_hash_bytes() {
+    usize max_size = MB(64);
+    byte *data = malloc(max_size);
+    if (!data) return 1;
+    for (usize i = 0; i < max_size; ++i) data[i] = (byte)(i * 131);
+
+    usize sizes[] = {8, 16, 64, 256, KB(1), KB(4), KB(64), MB(1), MB(16), MB(64)};
+    u64 sink = 0;
+    for (usize i = 0; i < countof(sizes); ++i) {
+        usize size = sizes[i];
+        // hash about 1 GiB per size, sliding through the buffer
+        usize iterations = MAX(GB(1) / size, 1);
+        usize offset = 0;
+
+        u64 start = time_now_ns();
+        for (usize n = 0; n < iterations; ++n) {
+            sink += hash_bytes(data + offset, size);
+            offset = offset + size + 1 <= max_size - size ? offset + 1 : 0;
+        }
+        f64 new_seconds = (time_now_ns() - start) / 1e9;
+        f64 new_bytes = (f64)size * iterations;
+
+        iterations = MAX(iterations / 16, 1);
+        offset = 0;
+        start = time_now_ns();
+        for (usize n = 0; n < iterations; ++n) {
+            sink += bench_fnv1a(data + offset, size);
+            offset = offset + size + 1 <= max_size - size ? offset + 1 : 0;
+        }
+        f64 fnv_seconds = (time_now_ns() - start) / 1e9;
+
+        printf("%9zu bytes: hash_bytes %6.2f GB/s, fnv1a %5.2f GB/s\n", size,
+               new_bytes / 1e9 / new_seconds, (f64)size * iterations / 1e9 / fnv_seconds);
+    }
+
+    printf("(%lu)\n", sink);
+    free(data);
+    return 0;
+}
+
+sharded_hash_map_def(u64, u64)
+
+#define BENCH_SHARDED_KEYS 1000000
+#define BENCH_SHARDED_OPS  16000000
+
+typedef struct {
+    ShardedHashMap(u64, u64) *sharded;
+    HashMap(u64, u64) *locked;
+    pthread_mutex_t *lock;
+    u64 ops;
+    u64 seed;
+} Bench_Sharded_Worker;
+
+// 95% gets, 5% inserts on random keys
+static void *bench_sharded_worker(void *arg) {
+    Bench_Sharded_Worker *w = arg;
+    u64 x = w->seed, hits = 0;
+    for (u64 i = 0; i < w->ops; ++i) {
+        x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+        u64 key = x % BENCH_SHARDED_KEYS;
+        b32 write = (x >> 32) % 100 < 5;
+
+        if (w->sharded) {
+            if (write) {
+                sharded_hash_map_insert(w->sharded, key, key);
+            } else {
+                u64 value;
+                b32 found;
+                sharded_hash_map_get(w->sharded, key, &value, &found);
+                hits += found;
+            }
+        } else {
+            pthread_mutex_lock(w->lock);
+            if (write) {
+                hash_map_insert(w->locked, key, key);
+            } else {
+                u64 *value;
+                hash_map_get(w->locked, key, &value);
+                hits += value != NULL;
+            }
+            pthread_mutex_unlock(w->lock);
+        }
+    }
+    w->seed = hits;
+    return NULL;
+}
+
+i32 example_bench_sharded_hash_map() {
+    static ShardedHashMap(u64, u64) sharded;
+    sharded_hash_map_init(&sharded, bench_u64_hash, bench_u64_equal);
+    HashMap(u64, u64) locked = {.key_hash = bench_u64_hash, .key_equal = bench_u64_equal};
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+    for (u64 k = 0; k < BENCH_SHARDED_KEYS; k += 2) {
+        sharded_hash_map_insert(&sharded, k, k);
+        hash_map_insert(&locked, k, k);
+    }
+
+    usize thread_counts[] = {1, 2, 4, 8, 16, 32, 64};
+    for (usize i = 0; i < countof(thread_counts); ++i) {
+        usize n = thread_counts[i];
+        f64 mops[2];
+        for (usize variant = 0; variant < 2; ++variant) {
+            pthread_t threads[64];
+            Bench_Sharded_Worker workers[64];
+
+            u64 start = time_now_ns();
+            for (usize t = 0; t < n; ++t) {
+                workers[t] = (Bench_Sharded_Worker) {
+                    .sharded = variant == 0 ? &sharded : NULL,
+                    .locked = &locked,
+                    .lock = &lock,
+                    .ops = BENCH_SHARDED_OPS / n,
+                    .seed = t * 0x9e3779b97f4a7c15 + 1,
+                };
+                pthread_create(&threads[t], NULL, bench_sharded_worker, &workers[t]);
+            }
+            for (usize t = 0; t < n; ++t) pthread_join(threads[t], NULL);
+            mops[variant] = BENCH_SHARDED_OPS / ((time_now_ns() - start) / 1e3);
+        }
+
+        printf("%2zu threads: sharded %6.1f Mops/s, one mutex %6.1f Mops/s\n", n, mops[0], mops[1]);
+    }
+
+    sharded_hash_map_free(&sharded);
+    hash_map_free(&locked);
+    return 0;
+}
+
+#define STRESS_SHARDED_KEYS    4000000
+#define STRESS_SHARDED_READERS 4
+#define STRESS_SHARDED_STABLE  50000
+#define STRESS_SHARDED_CHURN   50000
+#define STRESS_SHARDED_ROUNDS  50
+
+typedef struct {
+    ShardedHashMap(u64, u64) *map;
+    u64 *inserted;
+    b32 *stop;
+    u64 seed;
+    u64 reads;
+    u64 errors;
+} Stress_Sharded_Reader;
+
+// Every key below *inserted must be found with its value, keys past
+// STRESS_SHARDED_KEYS never exist, while the writer keeps growing tables
+static void *stress_sharded_reader(void *arg) {
+    Stress_Sharded_Reader *r = arg;
+    u64 x = r->seed;
+    u64 inserted;
+    while ((inserted = __atomic_load_n(r->inserted, __ATOMIC_ACQUIRE)) < STRESS_SHARDED_KEYS) {
+        x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+        u64 key = inserted ? x % inserted : 0;
+        u64 value = 0;
+        b32 found = false;
+        if (inserted) {
+            sharded_hash_map_get(r->map, key, &value, &found);
+            if (!found || value != ~key) r->errors++;
+        }
+        sharded_hash_map_get(r->map, STRESS_SHARDED_KEYS + key, &value, &found);
+        if (found) r->errors++;
+        r->reads += 2;
+    }
+    return NULL;
+}
+
+// Stable keys must always be found, churned keys come and go but
+// must never be found with a wrong value
+static void *stress_sharded_churn_reader(void *arg) {
+    Stress_Sharded_Reader *r = arg;
+    u64 x = r->seed;
+    while (!__atomic_load_n(r->stop, __ATOMIC_ACQUIRE)) {
+        x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+        u64 key = x % STRESS_SHARDED_STABLE;
+        u64 value = 0;
+        b32 found = false;
+        sharded_hash_map_get(r->map, key, &value, &found);
+        if (!found || value != ~key) r->errors++;
+
+        key = STRESS_SHARDED_STABLE + x % (STRESS_SHARDED_CHURN * (STRESS_SHARDED_ROUNDS + 1));
+        sharded_hash_map_get(r->map, key, &value, &found);
+        if (found && value != ~key) r->errors++;
+        r->reads += 2;
+    }
+    return NULL;
+}
+
+// Replaces all churned keys every round with the live count constant.
+// Tables rehash at the same capacity, so the arenas must stay within
+// a few times the live tables instead of growing every round
+static i32 stress_sharded_churn(void) {
+    static ShardedHashMap(u64, u64) sharded;
+    sharded_hash_map_init(&sharded, bench_u64_hash, bench_u64_equal);
+    for (u64 k = 0; k < STRESS_SHARDED_STABLE; ++k) sharded_hash_map_insert(&sharded, k, ~k);
+
+    b32 stop = false;
+    pthread_t threads[STRESS_SHARDED_READERS];
+    Stress_Sharded_Reader readers[STRESS_SHARDED_READERS];
+    for (usize t = 0; t < STRESS_SHARDED_READERS; ++t) {
+        readers[t] = (Stress_Sharded_Reader) {
+            .map = &sharded,
+            .stop = &stop,
+            .seed = t * 0x9e3779b97f4a7c15 + 1,
+        };
+        pthread_create(&threads[t], NULL, stress_sharded_churn_reader, &readers[t]);
+    }
+
+    f64 peak = 0;
+    for (u64 round = 0; round <= STRESS_SHARDED_ROUNDS; ++round) {
+        u64 base = STRESS_SHARDED_STABLE + round * STRESS_SHARDED_CHURN;
+        for (u64 k = base; k < base + STRESS_SHARDED_CHURN; ++k) sharded_hash_map_insert(&sharded, k, ~k);
+        if (round > 0) {
+            for (u64 k = base - STRESS_SHARDED_CHURN; k < base; ++k) sharded_hash_map_remove(&sharded, k);
+        }
+
+        usize arena_bytes = 0, table_bytes = 0;
+        for (isize s = 0; s < PSH_SHARDED_HASH_MAP_SHARDS; ++s) {
+            isize capacity = sharded.shards[s].table.capacity;
+            arena_bytes += sharded.shards[s].arena.current_offset;
+            table_bytes += capacity * (sizeof(*sharded.shards[s].table.items) + 1) + capacity / PSH_HASH_MAP_GROUP;
+        }
+        peak = MAX(peak, (f64)arena_bytes / table_bytes);
+    }
+
+    __atomic_store_n(&stop, true, __ATOMIC_RELEASE);
+    u64 reads = 0, errors = 0;
+    for (usize t = 0; t < STRESS_SHARDED_READERS; ++t) {
+        pthread_join(threads[t], NULL);
+        reads += readers[t].reads;
+        errors += readers[t].errors;
+    }
+
+    printf("%lu reads over %d churn rounds, %lu errors, arena at most %.2fx the live tables\n",
+           reads, STRESS_SHARDED_ROUNDS, errors, peak);
+    sharded_hash_map_free(&sharded);
+    // the next table lands below or right above the live one
+    return errors != 0 || peak > 4;
+}
+
+i32 example_stress_sharded_hash_map() {
+    static ShardedHashMap(u64, u64) sharded;
+    sharded_hash_map_init(&sharded, bench_u64_hash, bench_u64_equal);
+    u64 inserted = 0;
+
+    pthread_t threads[STRESS_SHARDED_READERS];
+    Stress_Sharded_Reader readers[STRESS_SHARDED_READERS];
+    for (usize t = 0; t < STRESS_SHARDED_READERS; ++t) {
+        readers[t] = (Stress_Sharded_Reader) {
+            .map = &sharded,
+            .inserted = &inserted,
+            .seed = t * 0x9e3779b97f4a7c15 + 1,
+        };
+        pthread_create(&threads[t], NULL, stress_sharded_reader, &readers[t]);
+    }
+
+    for (u64 k = 0; k < STRESS_SHARDED_KEYS; ++k) {
+        sharded_hash_map_insert(&sharded, k, ~k);
+        __atomic_store_n(&inserted, k + 1, __ATOMIC_RELEASE);
+    }
+
+    u64 reads = 0, errors = 0;
+    for (usize t = 0; t < STRESS_SHARDED_READERS; ++t) {
+        pthread_join(threads[t], NULL);
+        reads += readers[t].reads;
+        errors += readers[t].errors;
+    }
+
+    printf("%lu reads while growing to %d keys, %lu errors\n", reads, STRESS_SHARDED_KEYS, errors);
+    sharded_hash_map_free(&sharded);
+    if (errors != 0) return 1;
+
+    return stress_sharded_churn();
+}
+
+#define BENCH_ARENA_TASKS      20000
+#define BENCH_ARENA_TASK_BYTES KB(256)
+
+typedef struct {
+    ArenaPool *pool;        // NULL: arena_init and arena_destroy per task
+    AtomicArena *shared;
+    Arena *locked;
+    pthread_mutex_t *lock;
+    u64 tasks;
+} Bench_Arena_Worker;
+
+// A task fills BENCH_ARENA_TASK_BYTES of 64 byte nodes
+static void *bench_arena_task_worker(void *arg) {
+    Bench_Arena_Worker *w = arg;
+    for (u64 task = 0; task < w->tasks; ++task) {
+        Arena local = {0};
+        Arena *arena = w->pool ? arena_pool_get(w->pool) : (local = arena_init(MB(64)), &local);
+        for (usize i = 0; i < BENCH_ARENA_TASK_BYTES / 64; ++i) {
+            byte *node = arena_push(arena, byte, 64);
+            node[0] = (byte)i;
+        }
+        if (w->pool) arena_pool_put(w->pool, arena);
+        else arena_destroy(local);
+    }
+    return NULL;
+}
+
+static void *bench_arena_push_worker(void *arg) {
+    Bench_Arena_Worker *w = arg;
+    for (u64 i = 0; i < w->tasks; ++i) {
+        byte *node;
+        if (w->shared) {
+            node = atomic_arena_push(w->shared, byte, 64);
+        } else {
+            pthread_mutex_lock(w->lock);
+            node = arena_push(w->locked, byte, 64);
+            pthread_mutex_unlock(w->lock);
+        }
+        node[0] = (byte)i;
+    }
+    return NULL;
+}
+
+static f64 bench_arena_run(void *(*worker)(void *), Bench_Arena_Worker proto, usize n, u64 total) {
+    pthread_t threads[64];
+    Bench_Arena_Worker workers[64];
+
+    u64 start = time_now_ns();
+    for (usize t = 0; t < n; ++t) {
+        workers[t] = proto;
+        workers[t].tasks = total / n;
+        pthread_create(&threads[t], NULL, worker, &workers[t]);
+    }
+    for (usize t = 0; t < n; ++t) pthread_join(threads[t], NULL);
+    return (time_now_ns() - start) / 1e9;
+}
+
+i32 example_bench_arena_pool() {
+    usize thread_counts[] = {1, 4, 16, 64};
+    for (usize i = 0; i < countof(thread_counts); ++i) {
+        usize n = thread_counts[i];
+        ArenaPool pool = arena_pool_init(MB(64));
+        f64 fresh = bench_arena_run(bench_arena_task_worker, (Bench_Arena_Worker) {0}, n, BENCH_ARENA_TASKS);
+        f64 pooled = bench_arena_run(bench_arena_task_worker, (Bench_Arena_Worker) {.pool = &pool}, n, BENCH_ARENA_TASKS);
+        arena_pool_destroy(&pool);
+        printf("%2zu threads: arena per task %.3fs, arena pool %.3fs\n", n, fresh, pooled);
+    }
+
+    u64 pushes = 8000000;
+    for (usize i = 0; i < countof(thread_counts); ++i) {
+        usize n = thread_counts[i];
+        AtomicArena shared = atomic_arena_init(GB(1));
+        Arena locked = arena_init(GB(1));
+        pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+        f64 atomic = bench_arena_run(bench_arena_push_worker, (Bench_Arena_Worker) {.shared = &shared}, n, pushes);
+        f64 mutex = bench_arena_run(bench_arena_push_worker, (Bench_Arena_Worker) {.locked = &locked, .lock = &lock}, n, pushes);
+        atomic_arena_destroy(shared);
+        arena_destroy(locked);
+        printf("%2zu threads: atomic arena %6.1f Mpush/s, mutex arena %6.1f Mpush/s\n",
+               n, pushes / atomic / 1e6, pushes / mutex / 1e6);
+    }
+    return 0;
+}
+
+#define BENCH_ARENA_FILL GB(1)
+
+// Fills an arena with 64 byte nodes, then walks them in a random order
+static void bench_arena_fill(byte *name, ArenaOpt opt) {
+    u64 start = time_now_ns();
+    Arena arena = arena_init_opt(opt);
+    u64 **nodes = arena_push(&arena, u64 *, BENCH_ARENA_FILL / 128);
+    for (usize i = 0; i < BENCH_ARENA_FILL / 128; ++i) {
+        nodes[i] = arena_push(&arena, u64, 8);
+        nodes[i][0] = i;
+    }
+    f64 fill = (time_now_ns() - start) / 1e9;
+
+    start = time_now_ns();
+    u64 x = 1, sum = 0;
+    for (usize i = 0; i < BENCH_ARENA_FILL / 128; ++i) {
+        x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+        sum += nodes[x % (BENCH_ARENA_FILL / 128)][0];
+    }
+    f64 walk = (time_now_ns() - start) / 1e9;
+
+    printf("%-28s fill %.3fs, random walk %.3fs (%llu)\n", name, fill, walk, (unsigned long long)sum & 1);
+    arena_destroy(arena);
+}
+
+i32 example_bench_arena_pages() {
+    bench_arena_fill("page commits",      (ArenaOpt) {.reserve_size = GB(2)});
+    bench_arena_fill("64 MB commits",     (ArenaOpt) {.reserve_size = GB(2), .commit_size = MB(64)});
+    bench_arena_fill("geometric commits", (ArenaOpt) {.reserve_size = GB(2), .commit_size = MB(1), .commit_geometric = true});
+    bench_arena_fill("64 MB commits, prefault", (ArenaOpt) {.reserve_size = GB(2), .commit_size = MB(64), .prefault = true});
+    bench_arena_fill("THP",               (ArenaOpt) {.reserve_size = GB(2), .pages = ARENA_PAGES_THP});
+    bench_arena_fill("THP, 64 MB commits, prefault",
+                     (ArenaOpt) {.reserve_size = GB(2), .pages = ARENA_PAGES_THP, .commit_size = MB(64), .prefault = true});
+    bench_arena_fill("hugetlb",           (ArenaOpt) {.reserve_size = GB(2), .pages = ARENA_PAGES_HUGETLB});
+    return 0;
+}
+
+#define BENCH_POOL_LIVE 4096
+#define BENCH_POOL_OPS  20000000
+
+typedef struct {
+    Pool *pool;             // NULL: malloc and free
+    u64 ops;
+    u64 seed;
+} Bench_Pool_Worker;
+
+// Records of 16 to 512 bytes with random lifetimes
+static void *bench_pool_worker(void *arg) {
+    Bench_Pool_Worker *w = arg;
+    void **live = calloc(BENCH_POOL_LIVE, sizeof(*live));
+    u64 x = w->seed;
+    for (u64 i = 0; i < w->ops; ++i) {
+        x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+        usize slot = x % BENCH_POOL_LIVE;
+        if (live[slot]) {
+            if (w->pool) pool_free(w->pool, live[slot]);
+            else free(live[slot]);
+            live[slot] = NULL;
+        } else {
+            usize size = 16 + (x >> 32) % 497;
+            live[slot] = w->pool ? pool_alloc(w->pool, size) : malloc(size);
+            *(u64 *)live[slot] = i;
+        }
+    }
+    for (usize slot = 0; slot < BENCH_POOL_LIVE; ++slot) {
+        if (w->pool) pool_free(w->pool, live[slot]);
+        else free(live[slot]);
+    }
+    if (w->pool) pool_thread_flush(w->pool);
+    free(live);
+    return NULL;
+}
+
+i32 example_bench_pool() {
+    usize thread_counts[] = {1, 8};
+    for (usize i = 0; i < countof(thread_counts); ++i) {
+        usize n = thread_counts[i];
+        Pool locked = pool_init(GB(4));
+        Pool cached = pool_init(GB(4));
+        cached.thread_cache = true;
+        Pool *pools[] = {NULL, &locked, &cached};
+        f64 mops[3];
+
+        for (usize variant = 0; variant < 3; ++variant) {
+            pthread_t threads[8];
+            Bench_Pool_Worker workers[8];
+
+            u64 start = time_now_ns();
+            for (usize t = 0; t < n; ++t) {
+                workers[t] = (Bench_Pool_Worker) {
+                    .pool = pools[variant],
+                    .ops = BENCH_POOL_OPS / n,
+                    .seed = t * 0x9e3779b97f4a7c15 + 1,
+                };
+                pthread_create(&threads[t], NULL, bench_pool_worker, &workers[t]);
+            }
+            for (usize t = 0; t < n; ++t) pthread_join(threads[t], NULL);
+            mops[variant] = BENCH_POOL_OPS / ((time_now_ns() - start) / 1e3);
+        }
+
+        printf("%zu threads: malloc %6.1f Mops/s, pool %6.1f Mops/s, pool with thread cache %6.1f Mops/s\n",
+               n, mops[0], mops[1], mops[2]);
+        pool_destroy(&locked);
+        pool_destroy(&cached);
+    }
+    return 0;
+}
+
+#define BENCH_ARENA_LIST_TOKENS 100000000
+
+typedef struct {
+    u32 *items;
+    isize count;
+    isize capacity;
+} Bench_Tokens;
+
+i32 example_bench_arena_list() {
+    u64 start = time_now_ns();
+    Bench_Tokens heap = {0};
+    for (u32 i = 0; i < BENCH_ARENA_LIST_TOKENS; ++i) list_append(&heap, i);
+    f64 heap_time = (time_now_ns() - start) / 1e9;
+    list_free(heap);
+
+    // The token list is the only thing growing on the arena
+    start = time_now_ns();
+    Arena arena = arena_init(GB(2), .commit_size = MB(4));
+    Bench_Tokens in_place = {0};
+    for (u32 i = 0; i < BENCH_ARENA_LIST_TOKENS; ++i) list_arena_append(&arena, &in_place, i);
+    f64 in_place_time = (time_now_ns() - start) / 1e9;
+    usize in_place_used = arena.current_offset;
+    arena_destroy(arena);
+
+    // Something else is pushed after every growth, so every growth copies
+    start = time_now_ns();
+    arena = arena_init(GB(4), .commit_size = MB(4));
+    Bench_Tokens copied = {0};
+    for (u32 i = 0; i < BENCH_ARENA_LIST_TOKENS; ++i) {
+        isize capacity = copied.capacity;
+        list_arena_append(&arena, &copied, i);
+        if (copied.capacity != capacity) arena_push(&arena, u64);
+    }
+    f64 copied_time = (time_now_ns() - start) / 1e9;
+    usize copied_used = arena.current_offset;
+    arena_destroy(arena);
+
+    printf("malloc list:             %.3fs\n", heap_time);
+    printf("arena list, in place:    %.3fs, %zu MB of arena\n", in_place_time, in_place_used >> 20);
+    printf("arena list, copying:     %.3fs, %zu MB of arena\n", copied_time, copied_used >> 20);
+    return 0;
+}
+
+#define BENCH_SEG_LIST_ITEMS (4096 * 12288)
+
+typedef struct {
+    u64 *items;
+    isize count;
+    isize capacity;
+} Bench_U64s;
+
+seg_list_def(u64)
+
+i32 example_bench_seg_list() {
+    u64 worst = 0;
+    u64 start = time_now_ns();
+    Bench_U64s list = {0};
+    for (u64 batch = 0; batch < BENCH_SEG_LIST_ITEMS; batch += 4096) {
+        u64 before = time_now_ns();
+        for (u64 i = batch; i < batch + 4096; ++i) list_append(&list, i);
+        worst = MAX(worst, time_now_ns() - before);
+    }
+    f64 list_time = (time_now_ns() - start) / 1e9;
+    printf("list:     append %.3fs, worst 4096 appends %6.3f ms\n", list_time, worst / 1e6);
+
+    u64 sum = 0;
+    start = time_now_ns();
+    list_foreach(u64, it, &list) sum += *it;
+    printf("list:     iterate %.3fs (%llu)\n", (time_now_ns() - start) / 1e9, (unsigned long long)sum);
+    list_free(list);
+
+    worst = 0;
+    start = time_now_ns();
+    SegList(u64) seg = {0};
+    for (u64 batch = 0; batch < BENCH_SEG_LIST_ITEMS; batch += 4096) {
+        u64 before = time_now_ns();
+        for (u64 i = batch; i < batch + 4096; ++i) seg_list_append(&seg, i);
+        worst = MAX(worst, time_now_ns() - before);
+    }
+    f64 seg_time = (time_now_ns() - start) / 1e9;
+    printf("seg list: append %.3fs, worst 4096 appends %6.3f ms\n", seg_time, worst / 1e6);
+
+    sum = 0;
+    start = time_now_ns();
+    seg_list_foreach(u64, it, &seg) sum += *it;
+    printf("seg list: iterate %.3fs (%llu)\n", (time_now_ns() - start) / 1e9, (unsigned long long)sum);
+    seg_list_free(&seg);
+    return 0;
+}
+
+#define BENCH_FILE_MAP_PATH "bench_file_map.txt"
+#define BENCH_FILE_MAP_SIZE MB(256)
+
+static isize bench_count_lines(psh_s8 text) {
+    isize lines = 0;
+    for (isize i = 0; i < text.len; ++i) lines += text.s[i] == '\n';
+    return lines;
+}
+
+i32 example_bench_file_map() {
+    byte line[64];
+    memset(line, 'x', sizeof(line));
+    line[sizeof(line) - 1] = '\n';
+
+    Fd fd = fd_openw(BENCH_FILE_MAP_PATH);
+    for (usize written = 0; written < BENCH_FILE_MAP_SIZE; written += sizeof(line)) {
+        if (write(fd, line, sizeof(line)) != sizeof(line)) return 1;
+    }
+    fd_close(fd);
+
+    u64 start = time_now_ns();
+    Fd_Reader reader = {.fd = fd_openr(BENCH_FILE_MAP_PATH)};
+    if (!fd_read(&reader)) return 1;
+    isize lines = bench_count_lines(s8(reader.store.items, reader.store.count));
+    printf("fd_read:  %.3fs, %zd lines\n", (time_now_ns() - start) / 1e9, lines);
+    list_free(reader.store);
+
+    start = time_now_ns();
+    s8 text = file_map(BENCH_FILE_MAP_PATH, .sequential = true, .willneed = true);
+    if (!text.s) return 1;
+    lines = bench_count_lines(text);
+    printf("file_map: %.3fs, %zd lines\n", (time_now_ns() - start) / 1e9, lines);
+    file_unmap(text);
+
+    unlink(BENCH_FILE_MAP_PATH);
+    return 0;
+}
+
+#define BENCH_FD_WRITER_LINES 2000000
+
+// Feeds BENCH_FD_WRITER_LINES lines to wc -c, one write per line or
+// batched through Fd_Writer, and reads its answer back
+static f64 bench_fd_writer_run(byte *lines, b32 batched) {
+    Unix_Pipe in, out;
+    if (!pipe_open(&in, .cloexec = true) || !pipe_open(&out)) return -1;
+
+    Cmd cmd = {0};
+    Procs procs = {0};
+    cmd_append(&cmd, "wc", "-c");
+    if (!cmd_run(&cmd, .async = &procs, .fdin = in.read_fd, .fdout = out.write_fd)) return -1;
+    list_free(cmd);
+
+    u64 start = time_now_ns();
+    Fd_Reader reader = {.fd = out.read_fd};
+    if (batched) {
+        Fd_Writer writer = {.fd = in.write_fd};
+        for (usize i = 0; i < BENCH_FD_WRITER_LINES; ++i) fd_writer_push(&writer, s8(lines + i * 32, 32));
+        if (!fd_join(&reader, 1, &writer, 1)) return -1;
+        list_free(writer.queue);
+    } else {
+        for (usize i = 0; i < BENCH_FD_WRITER_LINES; ++i) {
+            if (write(in.write_fd, lines + i * 32, 32) != 32) return -1;
+        }
+        fd_close(in.write_fd);
+        if (!fd_read(&reader)) return -1;
+    }
+    f64 seconds = (time_now_ns() - start) / 1e9;
+
+    procs_block(&procs);
+    printf("%-22s %.3fs, wc counted %.*s", batched ? "Fd_Writer (writev):" : "write per line:",
+           seconds, sb_arg(reader.store));
+    list_free(reader.store);
+    return seconds;
+}
+
+i32 example_bench_fd_writer() {
+    byte *lines = malloc(BENCH_FD_WRITER_LINES * 32);
+    for (usize i = 0; i < BENCH_FD_WRITER_LINES; ++i) {
+        memset(lines + i * 32, 'a' + i % 26, 31);
+        lines[i * 32 + 31] = '\n';
+    }
+
+    bench_fd_writer_run(lines, false);
+    bench_fd_writer_run(lines, true);
+    free(lines);
+    return 0;
+}
@@ -8,6 +8,8 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdalign.h>
+#include <sys/resource.h>
+#include <sched.h>
 
 //TODO: add platform-agnostic wrappers
 
@@ -60,6 +62,14 @@ typedef struct {
 
 // da START
 
+// Lists and hash maps allocate from psh_pool, see pool START
+#ifdef PSH_USE_POOL
+    #define PSH_LIST_REALLOC(ptr, size)     pool_realloc(&psh_pool, (ptr), (size))
+    #define PSH_LIST_FREE(ptr)              pool_free(&psh_pool, (ptr))
+    #define PSH_HASH_MAP_REALLOC(ptr, size) pool_realloc(&psh_pool, (ptr), (size))
+    #define PSH_HASH_MAP_FREE(ptr)          pool_free(&psh_pool, (ptr))
+#endif
+
 #ifndef PSH_LIST_REALLOC
     #define PSH_LIST_REALLOC realloc
 #endif
@@ -127,6 +137,45 @@ typedef struct {
         (da)->count = (new_size);       \
     } while (0)
 
+// Lists that live in an Arena. Growth extends the items in place while
+// they are the last thing pushed onto the arena, and copies them to the
+// top of the arena otherwise. Never call psh_list_free on such a list.
+#define psh_list_arena_reserve(arena, da, expected_capacity)                                    \
+    do {                                                                                        \
+        if ((expected_capacity) > (da)->capacity) {                                             \
+            usize psh__old_size = (da)->capacity * sizeof(*(da)->items);                        \
+            if ((da)->capacity == 0) {                                                          \
+                (da)->capacity = PSH_LIST_INIT_CAP;                                               \
+            }                                                                                   \
+            while ((expected_capacity) > (da)->capacity) {                                      \
+                (da)->capacity *= 2;                                                            \
+            }                                                                                   \
+            (da)->items = arena_extend((arena), (da)->items, psh__old_size,                     \
+                                       (da)->capacity * sizeof(*(da)->items),                   \
+                                       alignof_type(max_align_t));                              \
+            PSH_ASSERT((da)->items != NULL && "Buy more RAM lol");                              \
+        }                                                                                       \
+    } while (0)
+
+#define psh_list_arena_append(arena, da, item)                \
+    do {                                                      \
+        psh_list_arena_reserve((arena), (da), (da)->count + 1); \
+        (da)->items[(da)->count++] = (item);                  \
+    } while (0)
+
+#define psh_list_arena_append_many(arena, da, new_items, new_items_count)                      \
+    do {                                                                                        \
+        psh_list_arena_reserve((arena), (da), (da)->count + (new_items_count));                 \
+        memcpy((da)->items + (da)->count, (new_items), (new_items_count)*sizeof(*(da)->items)); \
+        (da)->count += (new_items_count);                                                       \
+    } while (0)
+
+#define psh_list_arena_resize(arena, da, new_size)      \
+    do {                                                \
+        psh_list_arena_reserve((arena), (da), new_size); \
+        (da)->count = (new_size);                       \
+    } while (0)
+
 #define psh_list_clear(da) (da)->count = 0
 #define psh_list_last(da) (da)->items[(PSH_ASSERT((da)->count > 0), (da)->count-1)]
 #define psh_list_pop(da) (da)->items[(PSH_ASSERT((da)->count > 0), --(da)->count)]
@@ -159,38 +208,103 @@ typedef struct {
     #define PSH_HASH_MAP_MAX_LOAD_PERCENT 70
 #endif
 
-typedef enum {
-    PSH_HASH_MAP_ENTRY_EMPTY,
-    PSH_HASH_MAP_ENTRY_OCCUPIED,
-    PSH_HASH_MAP_ENTRY_DELETED,
-} Psh_HashMapEntryState;
+// Keys looked up together by psh_hash_map_get_many
+#ifndef PSH_HASH_MAP_BATCH
+    #define PSH_HASH_MAP_BATCH 16
+#endif
 
-typedef struct {
-    u64 hash;
-    u8 state;
-} Psh_HashMapEntryHeader;
+// Old slots moved per operation while an incremental resize is running
+#ifndef PSH_HASH_MAP_MIGRATE_SLOTS
+    #define PSH_HASH_MAP_MIGRATE_SLOTS 64
+#endif
+
+// Swiss table style open addressing. Every slot has a control byte
+// in a separate array: either PSH_HASH_MAP_CTRL_EMPTY or the top 7
+// bits of the slot's hash. A lookup compares a whole group of 16
+// control bytes at once and only touches the entries that match.
+//
+// Instead of tombstones, every group keeps an overflow byte with a
+// bit set for each hash that was pushed past the group while it was
+// full. A probe stops at the first group whose overflow bit for the
+// hash is clear, so removing an entry just marks its slot empty.
+#define PSH_HASH_MAP_GROUP 16
+#define PSH_HASH_MAP_CTRL_EMPTY 0x80
 
 #define Psh_HashMap(Key, Value)      struct Psh_ ## Key ## _ ## Value ## _HashMap
 #define Psh_HashMapEntry(Key, Value) struct Psh_ ## Key ## _ ## Value ## _HashMapEntry
 
-#define psh_hash_map_def(Key, Value)          \
-    Psh_HashMapEntry(Key, Value) {            \
-        Psh_HashMapEntryHeader header;        \
-        Key key;                              \
-        Value value;                          \
-    };                                        \
-    Psh_HashMap(Key, Value) {                 \
-        Psh_HashMapEntry(Key, Value) *items;  \
-        isize count;                          \
-        isize deleted_count;                  \
-        isize capacity;                       \
-        b32 fixed_capacity;                   \
-        u64 (*key_hash)(Key key);             \
-        b32 (*key_equal)(Key a, Key b);       \
+// The control bytes and overflow bytes live in the
+// same allocation as items, right after the entries.
+//
+// With incremental_resize set, growing keeps the old table alive and
+// every insert, get and remove moves PSH_HASH_MAP_MIGRATE_SLOTS of its
+// slots over, so no single operation pays for rehashing the whole map.
+// Until the migration is done, entries live in either table: iterating
+// needs psh_hash_map_finish_resize first and pointers returned by get
+// are only valid until the next operation.
+//
+// With arena set, tables are pushed onto the arena instead of going
+// through PSH_HASH_MAP_REALLOC. Tables left behind by growth are not
+// freed, the whole map goes away with arena_restore or arena_clear.
+//
+// mapping is set for maps opened with psh_hash_map_open, whose table
+// is a private file mapping that is unmapped instead of freed.
+#define psh_hash_map_def(Key, Value)              \
+    Psh_HashMapEntry(Key, Value) {                \
+        Key key;                                  \
+        Value value;                              \
+    };                                            \
+    Psh_HashMap(Key, Value) {                     \
+        Psh_HashMapEntry(Key, Value) *items;      \
+        u8 *ctrl;                                 \
+        u8 *overflow;                             \
+        isize count;                              \
+        isize deleted_count;                      \
+        isize capacity;                           \
+        b32 fixed_capacity;                       \
+        b32 incremental_resize;                   \
+        struct Arena *arena;                      \
+        byte *mapping;                            \
+        usize mapping_size;                       \
+        Psh_HashMapEntry(Key, Value) *old_items;  \
+        u8 *old_ctrl;                             \
+        isize old_capacity;                       \
+        isize migrated;                           \
+        u64 (*key_hash)(Key key);                 \
+        b32 (*key_equal)(Key a, Key b);           \
     };
 
+// Defined in the arena section
+struct Arena;
+
 u64 psh_hash_bytes(void const *data, usize size);
-void *psh__hash_map_resize(void *items, isize old_capacity, isize new_capacity, usize entry_size);
+void *psh__hash_map_alloc(struct Arena *arena, isize capacity, usize entry_size);
+isize psh__hash_map_fit(usize memory_size, usize entry_size);
+void psh__hash_map_reset(u8 *ctrl, isize capacity);
+isize psh__hash_map_claim(u8 *ctrl, u8 *overflow, isize capacity, u64 hash);
+isize psh__hash_map_first(u8 const *ctrl, isize capacity);
+
+// Files start with this much header, the table follows as it is in memory
+#define PSH__HASH_MAP_FILE_HEADER  64
+#define PSH__HASH_MAP_FILE_MAGIC   "PSHHMAP"
+#define PSH__HASH_MAP_FILE_VERSION 2
+
+typedef struct {
+    byte magic[8];
+    u32 version;
+    u32 group;              // PSH_HASH_MAP_GROUP of the build that saved it
+    u64 entry_size;
+    u64 capacity;
+    u64 count;
+    u64 deleted_count;
+    // mixed key_hash of the first used slot, 0 if the map is empty
+    u64 fingerprint;
+} Psh__HashMapFileHeader;
+
+b32 psh__hash_map_save(byte *path, void const *items, Psh__HashMapFileHeader header);
+void *psh__hash_map_open(byte *path, usize entry_size, byte **mapping, usize *mapping_size);
+b32 psh__hash_map_check_fingerprint(byte *path, u64 fingerprint, byte **mapping, usize mapping_size);
+void psh__hash_map_unmap(byte *mapping, usize mapping_size);
 
 // https://prng.di.unimi.it/splitmix64.c
 static inline u64 psh__hash_map_mix(u64 hash) {
@@ -202,141 +316,454 @@ static inline u64 psh__hash_map_mix(u64 hash) {
     return hash;
 }
 
-static inline isize psh__hash_map_index(u64 hash, isize capacity) {
-    return (isize)(hash & (u64)(capacity - 1));
+static inline u8 psh__hash_map_tag(u64 hash) { return (u8)(hash >> 57); }
+static inline u8 psh__hash_map_overflow_bit(u64 hash) { return (u8)(1u << ((hash >> 48) & 7)); }
+
+#if defined(__SSE2__)
+    #include <emmintrin.h>
+
+    #define PSH__HASH_MAP_MASK_SHIFT 0
+
+    // One bit per control byte equal to tag
+    static inline u64 psh__hash_map_match(u8 const *group, u8 tag) {
+        __m128i ctrl = _mm_loadu_si128((__m128i const *)group);
+        return (u32)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)tag)));
+    }
+#elif defined(__ARM_NEON)
+    #include <arm_neon.h>
+
+    #define PSH__HASH_MAP_MASK_SHIFT 2
+
+    // NEON has no movemask, so narrow to one nibble per control byte
+    // https://community.arm.com/arm-community-blogs/b/infrastructure-solutions-blog/posts/porting-x86-vector-bitmask-optimizations-to-arm-neon
+    static inline u64 psh__hash_map_match(u8 const *group, u8 tag) {
+        uint8x16_t eq = vceqq_u8(vld1q_u8(group), vdupq_n_u8(tag));
+        uint8x8_t nibbles = vshrn_n_u16(vreinterpretq_u16_u8(eq), 4);
+        return vget_lane_u64(vreinterpret_u64_u8(nibbles), 0) & UINT64_C(0x8888888888888888);
+    }
+#else
+    #define PSH__HASH_MAP_MASK_SHIFT 0
+
+    static inline u64 psh__hash_map_match_word(u64 word, u8 tag) {
+        u64 x = word ^ (UINT64_C(0x0101010101010101) * tag);
+        // high bit set in every byte of x that is zero
+        u64 zero = ~(((x & UINT64_C(0x7f7f7f7f7f7f7f7f)) + UINT64_C(0x7f7f7f7f7f7f7f7f)) | x | UINT64_C(0x7f7f7f7f7f7f7f7f));
+        return ((zero >> 7) * UINT64_C(0x0102040810204080)) >> 56;
+    }
+
+    static inline u64 psh__hash_map_match(u8 const *group, u8 tag) {
+        u64 words[2];
+        memcpy(words, group, sizeof(words));
+        return psh__hash_map_match_word(words[0], tag) | (psh__hash_map_match_word(words[1], tag) << 8);
+    }
+#endif
+
+static inline isize psh__hash_map_match_slot(u64 mask)
+{ return __builtin_ctzll(mask) >> PSH__HASH_MAP_MASK_SHIFT; }
+
+// Triangular probing over groups, which visits every
+// group once when the group count is a power of two
+typedef struct {
+    isize group;
+    isize step;
+    isize group_mask;
+} Psh__HashMapProbe;
+
+static inline Psh__HashMapProbe psh__hash_map_probe(u64 hash, isize capacity) {
+    isize group_mask = capacity / PSH_HASH_MAP_GROUP - 1;
+    return (Psh__HashMapProbe) {.group = (isize)(hash & (u64)group_mask), .group_mask = group_mask};
 }
 
-static inline isize psh__hash_map_step(u64 hash, isize capacity) {
-    return (isize)(((hash >> 32) | 1) & (u64)(capacity - 1));
+static inline b32 psh__hash_map_probe_next(Psh__HashMapProbe *probe, u8 const *overflow, u64 hash) {
+    if (!(overflow[probe->group] & psh__hash_map_overflow_bit(hash))) return false;
+    if (++probe->step > probe->group_mask) return false;
+    probe->group = (probe->group + probe->step) & probe->group_mask;
+    return true;
 }
 
-// memory_count must be a power of two. This storage is never resized or freed.
+// Sets found to the slot of the given table holding search_key or -1
+#define psh__hash_map_find_in(map, table_items, table_ctrl, table_capacity, hash, search_key, found) do {  \
+        (found) = -1;                                                                                    \
+        Psh__HashMapProbe psh__probe = psh__hash_map_probe((hash), (table_capacity));                    \
+        u8 psh__tag = psh__hash_map_tag(hash);                                                           \
+        do {                                                                                             \
+            isize psh__base = psh__probe.group * PSH_HASH_MAP_GROUP;                                     \
+            u64 psh__match = psh__hash_map_match((table_ctrl) + psh__base, psh__tag);                    \
+            for (; psh__match; psh__match &= psh__match - 1) {                                           \
+                isize psh__slot = psh__base + psh__hash_map_match_slot(psh__match);                      \
+                if ((map)->key_equal((table_items)[psh__slot].key, (search_key))) {                      \
+                    (found) = psh__slot;                                                                 \
+                    break;                                                                               \
+                }                                                                                        \
+            }                                                                                            \
+        } while ((found) < 0 &&                                                                          \
+                 psh__hash_map_probe_next(&psh__probe, (table_ctrl) + (table_capacity), (hash)));        \
+    } while (0)
+
+#define psh__hash_map_find(map, hash, search_key, found) \
+    psh__hash_map_find_in((map), (map)->items, (map)->ctrl, (map)->capacity, (hash), (search_key), (found))
+
+#define psh__hash_map_release(map, table) do {                                          \
+        if ((map)->mapping && (byte *)(table) == (map)->mapping + PSH__HASH_MAP_FILE_HEADER) { \
+            psh__hash_map_unmap((map)->mapping, (map)->mapping_size);                   \
+            (map)->mapping = NULL;                                                      \
+        } else if ((table) && !(map)->arena) {                                          \
+            PSH_HASH_MAP_FREE(table);                                                   \
+        }                                                                               \
+    } while (0)
+
+// Moves up to slots entries of the old table into the current one
+#define psh__hash_map_migrate(map, slots) do {                                                      \
+        if (!(map)->old_items) break;                                                               \
+        isize psh__end = MIN((map)->migrated + (slots), (map)->old_capacity);                       \
+        for (; (map)->migrated < psh__end; ++(map)->migrated) {                                     \
+            isize psh__i = (map)->migrated;                                                         \
+            if ((map)->old_ctrl[psh__i] == PSH_HASH_MAP_CTRL_EMPTY) continue;                       \
+            u64 psh__hash = psh__hash_map_mix((map)->key_hash((map)->old_items[psh__i].key));       \
+            isize psh__slot = psh__hash_map_claim(                                                  \
+                (map)->ctrl, (map)->overflow, (map)->capacity, psh__hash                            \
+            );                                                                                      \
+            PSH_ASSERT(psh__slot >= 0 && "Hash map capacity exhausted");                            \
+            (map)->items[psh__slot] = (map)->old_items[psh__i];                                     \
+            (map)->old_ctrl[psh__i] = PSH_HASH_MAP_CTRL_EMPTY;                                      \
+        }                                                                                           \
+        if ((map)->migrated == (map)->old_capacity) {                                               \
+            psh__hash_map_release((map), (map)->old_items);                                         \
+            (map)->old_items = NULL;                                                                \
+            (map)->old_ctrl = NULL;                                                                 \
+            (map)->old_capacity = 0;                                                                \
+        }                                                                                           \
+    } while (0)
+
+// Completes a running incremental resize, if any
+#define psh_hash_map_finish_resize(map) psh__hash_map_migrate((map), (map)->old_capacity)
+
+#define psh_hash_map_occupied(map, index) ((map)->ctrl[index] != PSH_HASH_MAP_CTRL_EMPTY)
+
+// memory holds both the entries and their control bytes, so capacity is the
+// largest power of two that fits in memory_count entries (at least 16).
+// This storage is never resized or freed.
 #define psh_hash_map_init_with_memory(map, memory, memory_count, hash_function, equal_function) do { \
         (map)->count = 0;                                                                            \
         (map)->deleted_count = 0;                                                                    \
         (map)->items = (memory);                                                                     \
-        (map)->capacity = (memory_count);                                                            \
+        (map)->capacity = psh__hash_map_fit(                                                         \
+            (usize)(memory_count) * sizeof(*(map)->items), sizeof(*(map)->items)                     \
+        );                                                                                           \
+        PSH_ASSERT((map)->capacity > 0 && "Hash map memory is too small");                           \
+        (map)->ctrl = (u8 *)((map)->items + (map)->capacity);                                        \
+        (map)->overflow = (map)->ctrl + (map)->capacity;                                             \
+        psh__hash_map_reset((map)->ctrl, (map)->capacity);                                           \
         (map)->fixed_capacity = true;                                                                \
+        (map)->incremental_resize = false;                                                           \
+        (map)->arena = NULL;                                                                         \
+        (map)->mapping = NULL;                                                                       \
+        (map)->old_items = NULL;                                                                     \
+        (map)->old_ctrl = NULL;                                                                      \
+        (map)->old_capacity = 0;                                                                     \
         (map)->key_hash = (hash_function);                                                           \
         (map)->key_equal = (equal_function);                                                         \
     } while (0)
 
-#define psh_hash_map_resize(map, requested_capacity) do {                                \
-        PSH_ASSERT(!(map)->fixed_capacity && "Cannot resize a fixed-capacity hash map"); \
-        isize psh__old_capacity = (map)->capacity;                                       \
-        isize psh__new_capacity = psh__old_capacity > 0                                  \
-            ? psh__old_capacity                                                         \
-            : PSH_HASH_MAP_INIT_CAP;                                                     \
-        while (psh__new_capacity < (requested_capacity)) {                               \
-            psh__new_capacity *= 2;                                                      \
-        }                                                                                \
-        (map)->items = psh__hash_map_resize(                                             \
-            (map)->items, psh__old_capacity, psh__new_capacity, sizeof(*(map)->items)    \
-        );                                                                               \
-        (map)->capacity = psh__new_capacity;                                             \
-        (map)->deleted_count = 0;                                                        \
+// Starts with a table of at least capacity slots on the arena,
+// growth pushes tables of twice the size onto the same arena
+#define psh_hash_map_init_with_arena(map, arena_pointer, initial_capacity, hash_function, equal_function) do { \
+        memset((map), 0, sizeof(*(map)));                                                              \
+        (map)->arena = (arena_pointer);                                                                \
+        (map)->key_hash = (hash_function);                                                             \
+        (map)->key_equal = (equal_function);                                                           \
+        psh_hash_map_resize((map), (initial_capacity));                                                \
     } while (0)
 
-#define psh_hash_map_clear(map) do {                                        \
-        memset((map)->items, 0, (map)->capacity * sizeof(*(map)->items));   \
-        (map)->count = 0;                                                   \
-        (map)->deleted_count = 0;                                           \
+// Entries are rehashed with key_hash, since only 7 bits of each hash are kept.
+// With incremental_resize set and the map not empty, this only starts the
+// migration of the entries and later operations finish it.
+#define psh_hash_map_resize(map, requested_capacity) do {                                    \
+        PSH_ASSERT(!(map)->fixed_capacity && "Cannot resize a fixed-capacity hash map");     \
+        psh_hash_map_finish_resize(map);                                                     \
+        isize psh__old_capacity = (map)->capacity;                                           \
+        isize psh__new_capacity = psh__old_capacity > 0                                      \
+            ? psh__old_capacity                                                             \
+            : MAX(PSH_HASH_MAP_INIT_CAP, PSH_HASH_MAP_GROUP);                                \
+        while (psh__new_capacity < (requested_capacity)) {                                   \
+            psh__new_capacity *= 2;                                                          \
+        }                                                                                    \
+        byte *psh__items = psh__hash_map_alloc((map)->arena, psh__new_capacity, sizeof(*(map)->items)); \
+        u8 *psh__ctrl = (u8 *)psh__items + (usize)psh__new_capacity * sizeof(*(map)->items); \
+        (map)->old_items = (map)->items;                                                     \
+        (map)->old_ctrl = (map)->ctrl;                                                       \
+        (map)->old_capacity = psh__old_capacity;                                             \
+        (map)->migrated = 0;                                                                 \
+        (map)->items = (void *)psh__items;                                                   \
+        (map)->ctrl = psh__ctrl;                                                             \
+        (map)->overflow = psh__ctrl + psh__new_capacity;                                     \
+        (map)->capacity = psh__new_capacity;                                                 \
+        (map)->deleted_count = 0;                                                            \
+        if (!(map)->incremental_resize || (map)->count == 0)                                 \
+            psh_hash_map_finish_resize(map);                                                 \
     } while (0)
 
-// inserting an existing key replaces its value
-#define psh_hash_map_insert(map, new_key, new_value) do {                                   \
-        if ((map)->capacity == 0) psh_hash_map_resize((map), PSH_HASH_MAP_INIT_CAP);        \
-        if (!(map)->fixed_capacity &&                                                       \
-            ((map)->count + (map)->deleted_count + 1) * 100 >                               \
-            (map)->capacity * PSH_HASH_MAP_MAX_LOAD_PERCENT)                                \
-        {                                                                                   \
-            isize psh__resize_capacity =                                                    \
-                ((map)->count + 1) * 100 > (map)->capacity * PSH_HASH_MAP_MAX_LOAD_PERCENT  \
-                    ? (map)->capacity * 2                                                   \
-                    : (map)->capacity;                                                      \
-            psh_hash_map_resize((map), psh__resize_capacity);                               \
-        }                                                                                   \
-        u64 psh__hash = psh__hash_map_mix((map)->key_hash(new_key));                        \
-        isize psh__index = psh__hash_map_index(psh__hash, (map)->capacity);                 \
-        isize psh__step = psh__hash_map_step(psh__hash, (map)->capacity);                   \
-        isize psh__target = -1;                                                             \
-        isize psh__first_deleted = -1;                                                      \
-        isize psh__increment_count = 1;                                                     \
-        for (isize psh__probe = 0; psh__probe < (map)->capacity; ++psh__probe) {            \
-            u8 psh__state = (map)->items[psh__index].header.state;                          \
-            if (psh__state == PSH_HASH_MAP_ENTRY_OCCUPIED) {                                \
-                if ((map)->items[psh__index].header.hash == psh__hash &&                    \
-                    (map)->key_equal((map)->items[psh__index].key, (new_key))) {            \
-                    psh__target = psh__index;                                               \
-                    psh__increment_count = 0;                                               \
-                    break;                                                                  \
-                }                                                                           \
-            } else if (psh__state == PSH_HASH_MAP_ENTRY_DELETED) {                          \
-                if (psh__first_deleted < 0) psh__first_deleted = psh__index;                \
-            } else {                                                                        \
-                psh__target = psh__first_deleted >= 0 ? psh__first_deleted : psh__index;    \
-                break;                                                                      \
-            }                                                                               \
-            psh__index = (psh__index + psh__step) & ((map)->capacity - 1);                  \
-        }                                                                                   \
-        if (psh__target < 0) psh__target = psh__first_deleted;                              \
-        PSH_ASSERT(psh__target >= 0 && "Hash map capacity exhausted");                      \
-        if ((map)->items[psh__target].header.state == PSH_HASH_MAP_ENTRY_DELETED) {         \
-            (map)->deleted_count--;                                                         \
+#define psh_hash_map_clear(map) do {                                    \
+        if ((map)->capacity > 0)                                        \
+            psh__hash_map_reset((map)->ctrl, (map)->capacity);          \
+        psh__hash_map_release((map), (map)->old_items);                 \
+        (map)->old_items = NULL;                                        \
+        (map)->old_ctrl = NULL;                                         \
+        (map)->old_capacity = 0;                                        \
+        (map)->count = 0;                                               \
+        (map)->deleted_count = 0;                                       \
+    } while (0)
+
+// inserting an existing key replaces its value.
+// deleted_count counts removals from overflowed groups, which
+// still lengthen probes until the next resize clears them
+#define psh_hash_map_insert(map, new_key, new_value) do {                                       \
+        if ((map)->capacity == 0) psh_hash_map_resize((map), PSH_HASH_MAP_INIT_CAP);            \
+        psh__hash_map_migrate((map), PSH_HASH_MAP_MIGRATE_SLOTS);                               \
+        u64 psh__hash = psh__hash_map_mix((map)->key_hash(new_key));                            \
+        isize psh__target;                                                                      \
+        psh__hash_map_find((map), psh__hash, (new_key), psh__target);                           \
+        if (psh__target >= 0) {                                                                 \
+            (map)->items[psh__target].key = (new_key);                                          \
+            (map)->items[psh__target].value = (new_value);                                      \
+            break;                                                                              \
+        }                                                                                       \
+        if ((map)->old_items) {                                                                 \
+            psh__hash_map_find_in((map), (map)->old_items, (map)->old_ctrl,                     \
+                                  (map)->old_capacity, psh__hash, (new_key), psh__target);      \
+            if (psh__target >= 0) {                                                             \
+                (map)->old_items[psh__target].key = (new_key);                                  \
+                (map)->old_items[psh__target].value = (new_value);                              \
+                break;                                                                          \
+            }                                                                                   \
+        }                                                                                       \
+        if (!(map)->fixed_capacity &&                                                           \
+            ((map)->count + (map)->deleted_count + 1) * 100 >                                   \
+            (map)->capacity * PSH_HASH_MAP_MAX_LOAD_PERCENT)                                    \
+        {                                                                                       \
+            isize psh__resize_capacity =                                                        \
+                ((map)->count + 1) * 100 > (map)->capacity * PSH_HASH_MAP_MAX_LOAD_PERCENT      \
+                    ? (map)->capacity * 2                                                       \
+                    : (map)->capacity;                                                          \
+            psh_hash_map_resize((map), psh__resize_capacity);                                   \
+        }                                                                                       \
+        psh__target = psh__hash_map_claim((map)->ctrl, (map)->overflow, (map)->capacity, psh__hash); \
+        PSH_ASSERT(psh__target >= 0 && "Hash map capacity exhausted");                          \
+        (map)->items[psh__target].key = (new_key);                                              \
+        (map)->items[psh__target].value = (new_value);                                          \
+        (map)->count++;                                                                         \
+    } while (0)
+
+#define psh_hash_map_get(map, search_key, result_pointer) do {                              \
+        *(result_pointer) = NULL;                                                           \
+        if ((map)->capacity <= 0) break;                                                    \
+        psh__hash_map_migrate((map), PSH_HASH_MAP_MIGRATE_SLOTS);                           \
+        u64 psh__hash = psh__hash_map_mix((map)->key_hash(search_key));                     \
+        isize psh__found;                                                                   \
+        psh__hash_map_find((map), psh__hash, (search_key), psh__found);                     \
+        if (psh__found >= 0) {                                                              \
+            *(result_pointer) = &(map)->items[psh__found].value;                            \
+            break;                                                                          \
         }                                                                                   \
-        (map)->items[psh__target].header.hash = psh__hash;                                  \
-        (map)->items[psh__target].header.state = PSH_HASH_MAP_ENTRY_OCCUPIED;               \
-        (map)->items[psh__target].key = (new_key);                                          \
-        (map)->items[psh__target].value = (new_value);                                      \
-        (map)->count += psh__increment_count;                                               \
+        if (!(map)->old_items) break;                                                       \
+        psh__hash_map_find_in((map), (map)->old_items, (map)->old_ctrl,                     \
+                              (map)->old_capacity, psh__hash, (search_key), psh__found);    \
+        if (psh__found >= 0) *(result_pointer) = &(map)->old_items[psh__found].value;       \
     } while (0)
 
-#define psh_hash_map_get(map, search_key, result_pointer) do {                    \
-        *(result_pointer) = NULL;                                                 \
-        if ((map)->capacity <= 0) break;                                          \
-        u64 psh__hash = psh__hash_map_mix((map)->key_hash(search_key));           \
-        isize psh__index = psh__hash_map_index(psh__hash, (map)->capacity);       \
-        isize psh__step = psh__hash_map_step(psh__hash, (map)->capacity);         \
-        for (isize psh__probe = 0; psh__probe < (map)->capacity; ++psh__probe) {  \
-            u8 psh__state = (map)->items[psh__index].header.state;                \
-            if (psh__state == PSH_HASH_MAP_ENTRY_EMPTY) break;                    \
-            if (psh__state == PSH_HASH_MAP_ENTRY_OCCUPIED &&                      \
-                (map)->items[psh__index].header.hash == psh__hash &&              \
-                (map)->key_equal((map)->items[psh__index].key, (search_key))) {   \
-                *(result_pointer) = &(map)->items[psh__index].value;              \
-                break;                                                            \
-            }                                                                     \
-            psh__index = (psh__index + psh__step) & ((map)->capacity - 1);        \
-        }                                                                         \
+// Sets results[i] like psh_hash_map_get does for keys[i]. The lookups are
+// software pipelined: key i + 2 * PSH_HASH_MAP_BATCH is hashed and its
+// control group prefetched, the matching entry of key i + PSH_HASH_MAP_BATCH
+// is prefetched, and key i is resolved, so many cache misses are in flight.
+// A running incremental resize advances by as much as key_count gets would
+// move, but not in between lookups, so all results stay valid together.
+#define psh_hash_map_get_many(map, keys, key_count, results) do {                                  \
+        isize psh__count = (isize)(key_count);                                                      \
+        if ((map)->capacity <= 0) {                                                                 \
+            for (isize psh__k = 0; psh__k < psh__count; ++psh__k) (results)[psh__k] = NULL;         \
+            break;                                                                                  \
+        }                                                                                           \
+        psh__hash_map_migrate((map), psh__count * PSH_HASH_MAP_MIGRATE_SLOTS);                      \
+        u64 psh__hashes[4 * PSH_HASH_MAP_BATCH];                                                    \
+        isize psh__ring = 4 * PSH_HASH_MAP_BATCH - 1;                                               \
+        isize psh__group_mask = (map)->capacity / PSH_HASH_MAP_GROUP - 1;                           \
+        for (isize psh__k = -2 * PSH_HASH_MAP_BATCH; psh__k < psh__count; ++psh__k) {               \
+            isize psh__ahead = psh__k + 2 * PSH_HASH_MAP_BATCH;                                     \
+            if (psh__ahead < psh__count) {                                                          \
+                u64 psh__hash = psh__hash_map_mix((map)->key_hash((keys)[psh__ahead]));             \
+                psh__hashes[psh__ahead & psh__ring] = psh__hash;                                    \
+                __builtin_prefetch((map)->ctrl + (psh__hash & (u64)psh__group_mask) * PSH_HASH_MAP_GROUP); \
+            }                                                                                       \
+            isize psh__near = psh__k + PSH_HASH_MAP_BATCH;                                          \
+            if (psh__near >= 0 && psh__near < psh__count) {                                         \
+                u64 psh__hash = psh__hashes[psh__near & psh__ring];                                 \
+                isize psh__base = (isize)(psh__hash & (u64)psh__group_mask) * PSH_HASH_MAP_GROUP;   \
+                u64 psh__match = psh__hash_map_match((map)->ctrl + psh__base, psh__hash_map_tag(psh__hash)); \
+                if (psh__match)                                                                     \
+                    __builtin_prefetch(&(map)->items[psh__base + psh__hash_map_match_slot(psh__match)]); \
+            }                                                                                       \
+            if (psh__k < 0) continue;                                                               \
+            isize psh__found;                                                                       \
+            psh__hash_map_find((map), psh__hashes[psh__k & psh__ring], (keys)[psh__k], psh__found); \
+            (results)[psh__k] = psh__found >= 0 ? &(map)->items[psh__found].value : NULL;           \
+            if (psh__found >= 0 || !(map)->old_items) continue;                                     \
+            psh__hash_map_find_in((map), (map)->old_items, (map)->old_ctrl, (map)->old_capacity,    \
+                                  psh__hashes[psh__k & psh__ring], (keys)[psh__k], psh__found);     \
+            if (psh__found >= 0) (results)[psh__k] = &(map)->old_items[psh__found].value;           \
+        }                                                                                           \
     } while (0)
 
-#define psh_hash_map_remove(map, search_key) do {                                       \
-        if ((map)->capacity <= 0) break;                                                \
-        u64 psh__hash = psh__hash_map_mix((map)->key_hash(search_key));                 \
-        isize psh__index = psh__hash_map_index(psh__hash, (map)->capacity);             \
-        isize psh__step = psh__hash_map_step(psh__hash, (map)->capacity);               \
-        for (isize psh__probe = 0; psh__probe < (map)->capacity; ++psh__probe) {        \
-            u8 psh__state = (map)->items[psh__index].header.state;                      \
-            if (psh__state == PSH_HASH_MAP_ENTRY_EMPTY) break;                          \
-            if (psh__state == PSH_HASH_MAP_ENTRY_OCCUPIED &&                            \
-                (map)->items[psh__index].header.hash == psh__hash &&                    \
-                (map)->key_equal((map)->items[psh__index].key, (search_key)))           \
-            {                                                                           \
-                (map)->items[psh__index].header.state = PSH_HASH_MAP_ENTRY_DELETED;     \
-                (map)->count--;                                                         \
-                (map)->deleted_count++;                                                 \
-                if ((map)->count == 0 && (map)->deleted_count * 10 >= (map)->capacity)  \
-                    psh_hash_map_clear(map);                                            \
-                break;                                                                  \
-            }                                                                           \
-            psh__index = (psh__index + psh__step) & ((map)->capacity - 1);              \
-        }                                                                               \
+// An entry still in the old table is simply marked empty there
+#define psh_hash_map_remove(map, search_key) do {                                           \
+        if ((map)->capacity <= 0) break;                                                    \
+        psh__hash_map_migrate((map), PSH_HASH_MAP_MIGRATE_SLOTS);                           \
+        u64 psh__hash = psh__hash_map_mix((map)->key_hash(search_key));                     \
+        isize psh__found;                                                                   \
+        psh__hash_map_find((map), psh__hash, (search_key), psh__found);                     \
+        if (psh__found >= 0) {                                                              \
+            (map)->ctrl[psh__found] = PSH_HASH_MAP_CTRL_EMPTY;                              \
+            if ((map)->overflow[psh__found / PSH_HASH_MAP_GROUP]) (map)->deleted_count++;   \
+        } else if ((map)->old_items) {                                                      \
+            psh__hash_map_find_in((map), (map)->old_items, (map)->old_ctrl,                 \
+                                  (map)->old_capacity, psh__hash, (search_key), psh__found); \
+            if (psh__found < 0) break;                                                      \
+            (map)->old_ctrl[psh__found] = PSH_HASH_MAP_CTRL_EMPTY;                          \
+        } else {                                                                            \
+            break;                                                                          \
+        }                                                                                   \
+        (map)->count--;                                                                     \
+        if ((map)->count == 0 && ((map)->deleted_count > 0 || (map)->old_items))            \
+            psh_hash_map_clear(map);                                                        \
     } while (0)
 
-#define psh_hash_map_free(map) do { if (!(map)->fixed_capacity) PSH_HASH_MAP_FREE((map)->items); } while(0)
+#define psh__hash_map_file_header(map) ((Psh__HashMapFileHeader *)(map)->mapping)
+
+// Mixed key_hash of the first used slot. A file opened with a key_hash
+// that hashes this key differently is rejected.
+#define psh__hash_map_fingerprint(map)                                                      \
+    (psh__hash_map_first((map)->ctrl, (map)->capacity) < 0 ? 0 :                            \
+     psh__hash_map_mix((map)->key_hash(                                                     \
+         (map)->items[psh__hash_map_first((map)->ctrl, (map)->capacity)].key)))
+
+// Writes the table of a map with plain Key and Value types (no pointers)
+// to path, ready to be mapped back by psh_hash_map_open. Evaluates to b32.
+#define psh_hash_map_save(map, path)                                                        \
+    (PSH_ASSERT(!(map)->old_items && "Finish the incremental resize before saving"),       \
+     psh__hash_map_save((path), (map)->items, (Psh__HashMapFileHeader) {                    \
+         .entry_size = sizeof(*(map)->items),                                               \
+         .capacity = (map)->capacity,                                                       \
+         .count = (map)->count,                                                             \
+         .deleted_count = (map)->deleted_count,                                             \
+         .fingerprint = psh__hash_map_fingerprint(map),                                     \
+     }))
+
+// Maps a file written by psh_hash_map_save in O(1), pages are read as the
+// map touches them. Writes go to a private copy-on-write view and never
+// reach the file; once the map grows its table moves to the heap. Files
+// from another format version, group width, entry type or key_hash are
+// rejected. Evaluates to b32.
+#define psh_hash_map_open(map, path, hash_function, equal_function)                         \
+    (memset((map), 0, sizeof(*(map))),                                                      \
+     (map)->key_hash = (hash_function),                                                     \
+     (map)->key_equal = (equal_function),                                                   \
+     (map)->items = psh__hash_map_open((path), sizeof(*(map)->items),                       \
+                                       &(map)->mapping, &(map)->mapping_size),              \
+     (map)->items != NULL &&                                                                \
+     ((map)->capacity = psh__hash_map_file_header(map)->capacity,                           \
+      (map)->count = psh__hash_map_file_header(map)->count,                                 \
+      (map)->deleted_count = psh__hash_map_file_header(map)->deleted_count,                 \
+      (map)->ctrl = (u8 *)((map)->items + (map)->capacity),                                 \
+      (map)->overflow = (map)->ctrl + (map)->capacity,                                      \
+      psh__hash_map_check_fingerprint((path), psh__hash_map_fingerprint(map),               \
+                                      &(map)->mapping, (map)->mapping_size)                 \
+      || (memset((map), 0, sizeof(*(map))),                                                 \
+          (map)->key_hash = (hash_function),                                                \
+          (map)->key_equal = (equal_function),                                              \
+          false)))
+
+#define psh_hash_map_free(map) do {                                         \
+        if ((map)->fixed_capacity) break;                                   \
+        psh__hash_map_release((map), (map)->old_items);                     \
+        psh__hash_map_release((map), (map)->items);                         \
+    } while (0)
 
 // hash map END
 
+// seg list START
+
+// A list that never moves its items. Segment k holds
+// PSH_SEG_LIST_FIRST << k items and is allocated when the list reaches
+// it, so append is O(1) without copying and pointers to items stay valid
+// until psh_seg_list_free. Set arena to push segments onto an Arena
+// instead of going through PSH_LIST_REALLOC:
+//
+//     Psh_SegList(Job) jobs = {.arena = &arena};
+
+#ifndef PSH_SEG_LIST_FIRST
+    #define PSH_SEG_LIST_FIRST 64   // must be a power of two
+#endif
+
+#define PSH_SEG_LIST_SEGMENTS 40
+
+#define Psh_SegList(T) struct Psh_ ## T ## _SegList
+
+#define psh_seg_list_def(Type)                  \
+    Psh_SegList(Type) {                         \
+        Type *segments[PSH_SEG_LIST_SEGMENTS];  \
+        isize count;                            \
+        struct Arena *arena;                    \
+    };
+
+void *psh__seg_list_alloc(struct Arena *arena, usize size);
+
+static inline isize psh__seg_list_segment(isize index) {
+    return 63 - __builtin_clzll((u64)index + PSH_SEG_LIST_FIRST)
+              - __builtin_ctzll(PSH_SEG_LIST_FIRST);
+}
+
+static inline isize psh__seg_list_offset(isize index)
+{ return index + PSH_SEG_LIST_FIRST - ((isize)PSH_SEG_LIST_FIRST << psh__seg_list_segment(index)); }
+
+// Pointer to the item at index
+#define psh_seg_list_at(list, index)                                        \
+    (PSH_ASSERT(0 <= (index) && (index) < (list)->count),                   \
+     (list)->segments[psh__seg_list_segment(index)] + psh__seg_list_offset(index))
+
+#define psh_seg_list_append(list, item)                                                     \
+    do {                                                                                    \
+        isize psh__segment = psh__seg_list_segment((list)->count);                          \
+        if ((list)->segments[psh__segment] == NULL) {                                       \
+            (list)->segments[psh__segment] = psh__seg_list_alloc((list)->arena,             \
+                ((usize)PSH_SEG_LIST_FIRST << psh__segment) * sizeof(**(list)->segments));  \
+        }                                                                                   \
+        (list)->segments[psh__segment][psh__seg_list_offset((list)->count)] = (item);       \
+        (list)->count++;                                                                    \
+    } while (0)
+
+// Walks one segment at a time, the outer loop only runs once
+// so break and continue work as in psh_list_foreach
+#define psh_seg_list_foreach(Type, it, list)                                                \
+    for (isize psh__i = 0; psh__i < (list)->count; psh__i = (list)->count)                  \
+        for (Type *it = (list)->segments[0], *psh__end = it + PSH_SEG_LIST_FIRST;           \
+             psh__i < (list)->count;                                                        \
+             ++psh__i, ++it == psh__end && psh__i < (list)->count                           \
+                ? (void)(it = (list)->segments[psh__seg_list_segment(psh__i)],              \
+                         psh__end = it + ((isize)PSH_SEG_LIST_FIRST << psh__seg_list_segment(psh__i))) \
+                : (void)0)
+
+// Keeps the segments for reuse
+#define psh_seg_list_clear(list) (list)->count = 0
+
+#define psh_seg_list_free(list)                                             \
+    do {                                                                    \
+        for (isize psh__s = 0; psh__s < PSH_SEG_LIST_SEGMENTS; ++psh__s) {  \
+            if (!(list)->arena) PSH_LIST_FREE((list)->segments[psh__s]);    \
+            (list)->segments[psh__s] = NULL;                                \
+        }                                                                   \
+        (list)->count = 0;                                                  \
+    } while (0)
+// seg list END
+
 // macros START
 
 #define psh_return_defer(value) do { result = (value); goto defer; } while(0)
@@ -381,11 +808,47 @@ void psh_logger(Psh_Log_Level level, byte *fmt, ...);
 typedef i32 Psh_Proc;
 #define PSH_INVALID_PROC -1
 
+typedef struct {
+    Psh_Proc pid;
+    i32 pidfd;          // -1 if the proc is polled instead
+    u64 started_ns;
+} Psh_Proc_Watch;
+
+typedef struct {
+    Psh_Proc_Watch *items;
+    usize count;
+    usize capacity;
+} Psh_Proc_Watches;
+
 typedef struct {
     Psh_Proc *items;
     usize count;
     usize capacity;
+    // watches.items[i] belongs to items[i]. The reaper
+    // epoll instance is open while watches.count > 0
+    Psh_Proc_Watches watches;
+    i32 reaper;
 } Psh_Procs;
+
+typedef struct {
+    Psh_Proc pid;
+    b32 exited;             // true if the proc exited normally
+    i32 exit_code;          // valid if exited
+    i32 signal;             // terminating signal if not exited
+    u64 wall_ns;            // time from launch to exit
+    struct rusage rusage;   // as reported by wait4
+} Psh_Proc_Status;
+
+// Blocks until any proc in procs finishes, in whichever order
+// they exit, removes it from procs and fills in its status.
+// Returns false if procs is empty or waiting failed.
+b32 psh_procs_wait_any(Psh_Procs *procs, Psh_Proc_Status *status);
+// Forgets every proc without waiting on it and closes the pidfds and
+// the reaper. Use this instead of setting count to 0 by hand.
+void psh_procs_reset(Psh_Procs *procs);
+// psh_procs_reset, then frees items
+void psh_procs_free(Psh_Procs *procs);
+b32 psh_proc_status_ok(Psh_Proc_Status status);
 // process END
 
 // fd START
@@ -400,6 +863,20 @@ Psh_Fd psh_fd_opena(byte *path);
 void psh_fd_close(Psh_Fd fd);
 void psh_fd_close_safe(Psh_Fd fd);
 b32 psh_fd_not_default(Psh_Fd fd);
+
+typedef struct {
+    b32 sequential;     // MADV_SEQUENTIAL: read ahead more, drop pages behind
+    b32 willneed;       // MADV_WILLNEED: start reading the whole file now
+    b32 populate;       // MAP_POPULATE: fault every page in before returning
+} Psh_File_Map_Opt;
+
+// Maps the file read only and returns its contents without copying.
+// s is NULL if the file could not be mapped or is not a regular file,
+// an empty file gives an empty view. Pass the view unchanged to psh_file_unmap.
+//     psh_s8 text = psh_file_map("deps.txt", .sequential = true);
+#define psh_file_map(path, ...) psh_file_map_opt((path), (Psh_File_Map_Opt) {__VA_ARGS__})
+psh_s8 psh_file_map_opt(byte *path, Psh_File_Map_Opt opt);
+void psh_file_unmap(psh_s8 view);
 // fd END
 
 // cmd START
@@ -410,6 +887,20 @@ typedef struct {
     usize capacity;
 } Psh_Cmd;
 
+typedef enum {
+    PSH_SPAWN_DEFAULT,
+    PSH_SPAWN_FORK,
+    // posix_spawn does not duplicate the parent's page tables
+    // (glibc uses clone(CLONE_VM | CLONE_VFORK) under the hood),
+    // so it stays cheap even when the parent is huge
+    PSH_SPAWN_POSIX,
+} Psh_Spawn_Backend;
+
+// Backend used when Psh_Cmd_Opt.spawn is PSH_SPAWN_DEFAULT
+#ifndef PSH_SPAWN_DEFAULT_BACKEND
+    #define PSH_SPAWN_DEFAULT_BACKEND PSH_SPAWN_FORK
+#endif
+
 typedef struct {
     Psh_Procs *async;
     u8 max_procs;
@@ -417,6 +908,10 @@ typedef struct {
     b32 keep_fdin_open;
     b32 keep_fdout_open;
     b32 keep_fderr_open;
+    Psh_Spawn_Backend spawn;
+    // Unless PSH_INVALID_FD, stdout is also duplicated into tap (a file or a pipe)
+    Psh_Fd tap;
+    b32 keep_tap_open;
 } Psh_Cmd_Opt;
 
 #define psh_cmd_append(cmd, ...)                    \
@@ -428,6 +923,7 @@ typedef struct {
             (Psh_Cmd_Opt) {.fdin = STDIN_FILENO,        \
                        .fdout = STDOUT_FILENO,          \
                        .fderr = STDERR_FILENO,          \
+                       .tap = PSH_INVALID_FD,           \
                        __VA_ARGS__                      \
                     })
 b32 psh_cmd_run_opt(Psh_Cmd *cmd, Psh_Cmd_Opt opt);
@@ -439,6 +935,7 @@ b32 psh_procs_block(Psh_Procs *procs);
 typedef struct {
     Psh_Procs *async;
     u8 max_procs;
+    usize pipe_size;    // capacity of pipes between stages, see Psh_Pipe_Opt
 } Psh_Pipeline_Opt;
 
 typedef struct {
@@ -454,6 +951,7 @@ typedef struct {
             (Psh_Cmd_Opt) {.fdin = STDIN_FILENO,    \
                        .fdout = STDOUT_FILENO,  \
                        .fderr = STDERR_FILENO,  \
+                       .tap = PSH_INVALID_FD,   \
                        __VA_ARGS__              \
                     })
 b32 psh_pipeline_chain_opt(Psh_Pipeline *p, Psh_Cmd *cmd, Psh_Cmd_Opt opt);
@@ -464,6 +962,73 @@ b32 psh_pipeline_end(Psh_Pipeline *p);
                       psh_latch; psh_latch = 0, psh_pipeline_end(p))
 // pipeline END
 
+// graph START
+
+typedef isize Psh_Job;
+#define PSH_INVALID_JOB -1
+
+psh_list_def(Psh_Job)
+
+typedef enum {
+    PSH_JOB_PENDING,
+    PSH_JOB_RUNNING,
+    PSH_JOB_DONE,
+    PSH_JOB_FAILED,
+} Psh_Job_State;
+
+typedef struct {
+    Psh_Cmd cmd;
+    Psh_Cmd_Opt opt;
+    List(Psh_Job) successors;
+    isize pending;          // predecessors that have not finished yet
+    Psh_Job_State state;
+    Psh_Proc pid;           // the command, not its tap helper
+    isize live;             // procs of the job that have not exited yet
+    Psh_Proc_Status status;
+    u64 path_ns;            // wall time of the longest chain ending here
+    Psh_Job critical_pred;  // predecessor on that chain
+} Psh_Job_Node;
+
+psh_list_def(Psh_Job_Node)
+psh_hash_map_def(Psh_Proc, Psh_Job)
+
+typedef struct {
+    u8 max_procs;
+} Psh_Graph_Opt;
+
+typedef struct {
+    List(Psh_Job_Node) nodes;
+    Psh_Procs procs;
+    Psh_HashMap(Psh_Proc, Psh_Job) running;
+    // Filled in by psh_graph_run, first job to last
+    List(Psh_Job) critical_path;
+    u64 critical_ns;
+} Psh_Graph;
+
+// Takes over the arguments of cmd, like psh_pipeline_chain
+#define psh_graph_add(graph, cmd, ...)              \
+        psh_graph_add_opt(graph, cmd,               \
+            (Psh_Cmd_Opt) {.fdin = STDIN_FILENO,    \
+                       .fdout = STDOUT_FILENO,      \
+                       .fderr = STDERR_FILENO,      \
+                       .tap = PSH_INVALID_FD,       \
+                       __VA_ARGS__                  \
+                    })
+Psh_Job psh_graph_add_opt(Psh_Graph *g, Psh_Cmd *cmd, Psh_Cmd_Opt opt);
+// job is started only after dependency has finished successfully
+void psh_graph_depend(Psh_Graph *g, Psh_Job job, Psh_Job dependency);
+
+// Runs every job as soon as its last dependency exits, with at most
+// max_procs procs at a time (a job with .tap takes two). A tapped job is
+// done once the tap helper has exited as well. After the first failure
+// no new jobs are started, the running ones are waited for and false is
+// returned.
+#define psh_graph_run(graph, ...) \
+    psh_graph_run_opt(graph, (Psh_Graph_Opt) {__VA_ARGS__})
+b32 psh_graph_run_opt(Psh_Graph *g, Psh_Graph_Opt opt);
+void psh_graph_free(Psh_Graph *g);
+// graph END
+
 // sb START
 
 typedef struct {
@@ -494,27 +1059,147 @@ typedef struct {
     Psh_Fd write_fd;
 } Psh_Unix_Pipe;
 
-b32 psh_pipe_open(Psh_Unix_Pipe *upipe);
+typedef struct {
+    // Requested capacity in bytes, capped at /proc/sys/fs/pipe-max-size.
+    // Zero keeps the system default (64 KiB on Linux).
+    usize pipe_size;
+    // Mark both ends close-on-exec. Commands still get the end they are
+    // given as fdin/fdout, but not the other one, so a command fed by a
+    // Psh_Fd_Writer sees EOF once the writer closes its end.
+    b32 cloexec;
+} Psh_Pipe_Opt;
+
+b32 psh_pipe_open_opt(Psh_Unix_Pipe *upipe, Psh_Pipe_Opt opt);
+#define psh_pipe_open(upipe, ...)     \
+    psh_pipe_open_opt(upipe, (Psh_Pipe_Opt) {__VA_ARGS__})
 // pipe END
 
 // reader START
 
-typedef struct {
+#ifndef PSH_FD_READ_MIN_CHUNK
+    #define PSH_FD_READ_MIN_CHUNK KB(64)
+#endif
+
+#ifndef PSH_FD_READ_MAX_CHUNK
+    #define PSH_FD_READ_MAX_CHUNK MB(4)
+#endif
+
+typedef struct Psh_Fd_Reader Psh_Fd_Reader;
+typedef void (*Psh_Fd_Reader_Callback)(Psh_Fd_Reader *reader, psh_s8 data);
+
+struct Psh_Fd_Reader {
     Psh_Fd fd;
     Psh_Sb store;
     b32 ready;
     b32 marked_nb;
-} Psh_Fd_Reader;
+    // Spare capacity reserved in store before each read. Doubles
+    // while reads keep filling it, up to PSH_FD_READ_MAX_CHUNK, or
+    // with limit_store up to keep_head + keep_tail (at least
+    // PSH_FD_READ_MIN_CHUNK)
+    usize chunk;
+    // Streaming mode. If set, on_data gets every complete line
+    // (without the newline) as soon as it is read, or every chunk
+    // as is if stream_chunks is set. store then only keeps the
+    // unconsumed tail. Lines longer than PSH_FD_READ_MAX_CHUNK
+    // are handed out in pieces, so memory stays bounded.
+    Psh_Fd_Reader_Callback on_data;
+    void *user_data;
+    b32 stream_chunks;
+    // Bounded capture. If limit_store is set, store keeps only the
+    // first keep_head and the last keep_tail bytes of the output and
+    // counts the bytes in between in dropped. The fd is still drained
+    // until EOF, so the writer never blocks. The tail is kept in a
+    // ring buffer and appended to store at EOF, or when reading fails.
+    b32 limit_store;
+    usize keep_head;
+    usize keep_tail;
+    usize dropped;
+    byte *tail_ring;
+    usize tail_start;
+    usize tail_count;
+};
 
 typedef struct {
     b32 keep_fd_open;
     b32 nonblocking;
+    // Expected amount of bytes, reserved in store up front
+    usize size_hint;
 } Psh_Fd_Reader_Opt;
 
 b32 psh_fd_read_opt(Psh_Fd_Reader *r, Psh_Fd_Reader_Opt opt);
 #define psh_fd_read(reader, ...)     \
     psh_fd_read_opt(reader, (Psh_Fd_Reader_Opt) {__VA_ARGS__})
 b32 psh_fd_readers_join(Psh_Fd_Reader r[], usize rcount);
+
+// Writes queued data to an fd, usually the stdin of a command. Only
+// views are queued, their memory must stay valid until the writer is
+// ready. Every flush hands up to IOV_MAX segments to one writev.
+typedef struct {
+    Psh_Fd fd;
+    struct {
+        psh_s8 *items;
+        isize count;
+        isize capacity;
+    } queue;
+    isize sent;         // segments of queue written completely
+    usize offset;       // bytes of queue.items[sent] already written
+    b32 ready;          // queue written and fd closed
+    b32 marked_nb;
+    // Set if the other end was closed before everything was written,
+    // the rest of the queue is dropped. Not treated as an error.
+    b32 broken;
+} Psh_Fd_Writer;
+
+typedef struct {
+    b32 keep_fd_open;
+    b32 nonblocking;
+} Psh_Fd_Writer_Opt;
+
+void psh_fd_writer_push(Psh_Fd_Writer *writer, psh_s8 data);
+#define psh_fd_writer_push_sb(writer, sb) \
+    psh_fd_writer_push((writer), psh_s8((sb).items, (sb).count))
+
+// Writes the queue, then closes the fd unless keep_fd_open is set.
+// With nonblocking it writes what fits right now and returns.
+b32 psh_fd_write_opt(Psh_Fd_Writer *writer, Psh_Fd_Writer_Opt opt);
+#define psh_fd_write(writer, ...)     \
+    psh_fd_write_opt(writer, (Psh_Fd_Writer_Opt) {__VA_ARGS__})
+
+// Feeds writers and drains readers from one poll loop until all of them
+// are ready, so a command that blocks on a full stdout while we block on
+// its full stdin cannot deadlock
+b32 psh_fd_join(Psh_Fd_Reader r[], usize rcount, Psh_Fd_Writer w[], usize wcount);
+
+// Persistent epoll based multiplexer for many readers. Readers are
+// registered once and every wakeup only touches the readers that
+// are ready, no matter how many are registered. Linux only.
+typedef struct {
+    Psh_Fd epoll;
+    usize pending;              // registered readers that are not ready yet
+    struct Psh__Uring *uring;   // set if the io_uring backend is used
+} Psh_Reactor;
+
+typedef struct {
+    // Use io_uring with multishot reads into a ring of provided
+    // buffers, so reading costs no syscalls per read. Streaming
+    // readers get their lines straight from those buffers, other
+    // readers still copy them into store. Falls back to epoll if
+    // the kernel does not support it (needs 6.7+).
+    b32 io_uring;
+    u32 buffer_count;   // power of two, default 64
+    u32 buffer_size;    // default PSH_FD_READ_MIN_CHUNK
+} Psh_Reactor_Opt;
+
+b32 psh_reactor_init_opt(Psh_Reactor *reactor, Psh_Reactor_Opt opt);
+#define psh_reactor_init(reactor, ...)     \
+    psh_reactor_init_opt(reactor, (Psh_Reactor_Opt) {__VA_ARGS__})
+// reader must stay at the same address until it is ready
+b32 psh_reactor_add(Psh_Reactor *reactor, Psh_Fd_Reader *reader);
+// Waits up to timeout ms (-1 blocks) and reads every reader that became readable
+b32 psh_reactor_poll(Psh_Reactor *reactor, i64 timeout);
+// Reads until every registered reader is ready
+b32 psh_reactor_join(Psh_Reactor *reactor);
+void psh_reactor_close(Psh_Reactor *reactor);
 // reader END
 
 // arena START
@@ -526,23 +1211,56 @@ b32 psh_fd_readers_join(Psh_Fd_Reader r[], usize rcount);
 // Default to 1 gb if arena is zero initialized
 #define ARENA_RESERVE_SIZE GB(1)
 
-typedef struct {
+// Huge page size assumed for ARENA_PAGES_THP and ARENA_PAGES_HUGETLB
+#ifndef ARENA_HUGE_PAGE_SIZE
+    #define ARENA_HUGE_PAGE_SIZE MB(2)
+#endif
+
+typedef struct Arena {
     byte* base_ptr;         // Start of the reservation
     usize reserved_size;    // Total size (e.g., 1GB)
     usize committed_size;   // Currently committed memory
     usize current_offset;   // Bump pointer
     usize page_size;        // size of one memory page
+    usize commit_size;      // Smallest step committed at once
+    usize retain_size;      // arena_clear gives back pages above this
+    b32 commit_geometric;   // Every commit at least doubles the committed memory
+    b32 prefault;           // Fault committed pages in right away
 } Arena;
 
+typedef enum {
+    ARENA_PAGES_DEFAULT,
+    // Transparent huge pages, the reservation is aligned for them
+    ARENA_PAGES_THP,
+    // Pages of ARENA_HUGE_PAGE_SIZE from the hugetlbfs pool, the whole
+    // reservation is taken from the pool. Falls back to ARENA_PAGES_THP
+    // when that pool is missing or too small
+    ARENA_PAGES_HUGETLB,
+} ArenaPages;
+
+typedef struct {
+    usize reserve_size;     // 0 means ARENA_RESERVE_SIZE
+    ArenaPages pages;
+    usize commit_size;
+    b32 commit_geometric;
+    b32 prefault;
+    usize retain_size;      // 0 keeps everything committed on arena_clear
+} ArenaOpt;
+
 typedef usize ArenaSP;
 
-Arena arena_init(usize reserve_size);
+// arena_init(GB(8), .pages = ARENA_PAGES_THP, .commit_size = MB(64), .prefault = true)
+#define arena_init(reserve, ...) arena_init_opt((ArenaOpt) {.reserve_size = (reserve), __VA_ARGS__})
+Arena arena_init_opt(ArenaOpt opt);
 void arena_destroy(Arena arena);
 void *arena_push_(Arena *arena, usize size, usize align, usize n);
 void arena_pop(Arena *arena, usize size);
 ArenaSP arena_savepoint(Arena *arena);
 void arena_restore(Arena *arena, ArenaSP save_point);
 void arena_clear(Arena *arena);
+// Grows ptr to new_size in place if it ends at the top of the arena,
+// otherwise pushes a new block and copies old_size bytes over
+void *arena_extend(Arena *arena, void *ptr, usize old_size, usize new_size, usize align);
 
 #if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
     #define alignof_type(T) _Alignof(T)
@@ -590,8 +1308,322 @@ PSH_THREAD_CTX_MOD static ThreadCtx thread_ctx = {0};
 Scratch scratch_get_(Arena *conflicting_permanent_arenas[], usize conflict_num);
 #define scratch_get(...) scratch_get_( \
         ((Arena *[]){__VA_ARGS__}), (sizeof((Arena *[]){__VA_ARGS__}) / sizeof(Arena *)))
+
+static inline void psh__spin_pause(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+static inline void psh__spin_lock(u32 *lock) {
+    for (u32 spins = 0; __atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE); ++spins) {
+        if (spins < 64) psh__spin_pause();
+        else sched_yield();
+    }
+}
+
+static inline void psh__spin_unlock(u32 *lock)
+{ __atomic_store_n(lock, 0, __ATOMIC_RELEASE); }
+
+// An arena many threads can push into at once. The bump pointer moves
+// with a compare and swap, only committing new pages takes a lock.
+// Must be created with atomic_arena_init. Pop, restore and clear are
+// not safe while other threads push.
+
+// Pages committed at once, so the lock is taken rarely
+#ifndef ATOMIC_ARENA_COMMIT_SIZE
+    #define ATOMIC_ARENA_COMMIT_SIZE KB(256)
+#endif
+
+typedef struct {
+    byte* base_ptr;
+    usize reserved_size;
+    usize committed_size;   // only grows, read without the lock
+    usize current_offset;   // bump pointer, moved atomically
+    usize page_size;
+    u32 commit_lock;
+} AtomicArena;
+
+AtomicArena atomic_arena_init(usize reserve_size);
+void atomic_arena_destroy(AtomicArena arena);
+void *atomic_arena_push_(AtomicArena *arena, usize size, usize align, usize n);
+void atomic_arena_clear(AtomicArena *arena);
+
+#define atomic_arena_push(...)         atomic_pushx_(__VA_ARGS__, atomic_push2_, atomic_push1_)(__VA_ARGS__)
+#define atomic_pushx_(a, b, c, d, ...) d
+#define atomic_push1_(a_ptr, t)        atomic_arena_push_(a_ptr, sizeof(t), alignof_type(t), 1)
+#define atomic_push2_(a_ptr, t, n)     atomic_arena_push_(a_ptr, sizeof(t), alignof_type(t), n)
+
+// Hands out arenas to threads and takes them back cleared but still
+// mapped and committed, so short tasks skip mmap, mprotect and munmap.
+// The Arena structs live in the pool and keep their address.
+// A zero initialized pool makes arenas like a zero initialized Arena.
+typedef struct ArenaPoolEntry {
+    Arena arena;
+    struct ArenaPoolEntry *next;
+} ArenaPoolEntry;
+
+typedef struct {
+    ArenaOpt arena_opt;     // used for every new arena
+    u32 lock;
+    Arena entries;          // every ArenaPoolEntry ever created
+    ArenaPoolEntry *free;
+} ArenaPool;
+
+#define arena_pool_init(reserve, ...) arena_pool_init_opt((ArenaOpt) {.reserve_size = (reserve), __VA_ARGS__})
+ArenaPool arena_pool_init_opt(ArenaOpt arena_opt);
+Arena *arena_pool_get(ArenaPool *pool);
+void arena_pool_put(ArenaPool *pool, Arena *arena);
+// Every arena must have been put back
+void arena_pool_destroy(ArenaPool *pool);
 // arena END
 
+// pool START
+
+// A general purpose allocator on top of an Arena for objects that are
+// freed in any order. Small sizes are rounded up to a power of two and
+// every size class keeps an intrusive free list, so alloc and free are
+// O(1). Blocks below POOL_SLAB_SIZE are cut from slabs of one class.
+// Larger blocks, like the tables of big hash maps, take a run of whole
+// slabs, so they waste less than a slab instead of up to half. A word
+// per slab records its class or run length, so blocks carry no header
+// and free needs no size. Small blocks go back to the free lists. A
+// freed run is given back to the arena if it is the last thing in it,
+// otherwise it is kept on a free list by length for later large
+// blocks. Runs are split but never merged. Runs longer than
+// POOL_RETURN_SLABS also give their pages back to the kernel.
+//
+// All calls are thread safe. With thread_cache set, small blocks go
+// through a per-thread cache and the pool lock is only taken to move
+// POOL_CACHE_BLOCKS / 2 blocks at a time. A thread should call
+// pool_thread_flush before it exits, or its cached blocks stay unused.
+// Every pool gets a new id when it is set up and caches are tagged
+// with it. pool_destroy only needs the calling thread to have flushed.
+// What other threads still cache for the destroyed pool is dropped
+// unused, even if a new pool is set up at the same address.
+//
+// A zero initialized Pool works. Define PSH_USE_POOL before including
+// this file to back every list and hash map with psh_pool.
+
+// Virtual memory a pool reserves unless told otherwise
+#ifndef POOL_RESERVE_SIZE
+    #define POOL_RESERVE_SIZE GB(64)
+#endif
+
+#ifndef POOL_SLAB_SIZE
+    #define POOL_SLAB_SIZE KB(64)
+#endif
+
+#ifndef POOL_CACHE_BLOCKS
+    #define POOL_CACHE_BLOCKS 64
+#endif
+
+// Pools that one thread can cache blocks for at once
+#ifndef POOL_THREAD_CACHES
+    #define POOL_THREAD_CACHES 4
+#endif
+
+#ifndef POOL_RETURN_SLABS
+    #define POOL_RETURN_SLABS 16
+#endif
+
+#define POOL_MIN_CLASS 4    // 16 bytes
+#define POOL_CLASSES   48
+#define POOL_RUN       0x80000000u  // slab starts a run of the low bits slabs
+#define POOL_RUN_LISTS 64           // one per run length, longer runs share the last
+
+typedef struct PoolBlock {
+    struct PoolBlock *next;
+} PoolBlock;
+
+// Header of a free run, kept in its first slab
+typedef struct PoolRun {
+    struct PoolRun *next;
+    usize slabs;
+} PoolRun;
+
+typedef struct {
+    Arena arena;
+    b32 thread_cache;
+    u32 lock;
+    u64 id;
+    u32 *slabs;             // class of every slab, or POOL_RUN | length
+    PoolRun *runs[POOL_RUN_LISTS];
+    PoolBlock *free[POOL_CLASSES];
+    byte *carve[POOL_CLASSES];      // rest of the current slab
+    byte *carve_end[POOL_CLASSES];
+} Pool;
+
+// pool_init(GB(4), .pages = ARENA_PAGES_THP)
+#define pool_init(reserve, ...) pool_init_opt((ArenaOpt) {.reserve_size = (reserve), __VA_ARGS__})
+Pool pool_init_opt(ArenaOpt arena_opt);
+void *pool_alloc(Pool *pool, usize size);
+void pool_free(Pool *pool, void *ptr);
+// Grows in place while the size still fits the block, or by taking
+// the slabs after a large block that ends the arena
+void *pool_realloc(Pool *pool, void *ptr, usize size);
+void pool_thread_flush(Pool *pool);
+void pool_destroy(Pool *pool);
+
+#ifdef PSH_USE_POOL
+    extern Pool psh_pool;
+#endif
+// pool END
+
+// sharded hash map START
+
+// A hash map for many threads, split into shards that each hold a
+// psh_hash_map. Writers lock one shard. Readers take no lock: get
+// copies the value out under the shard's sequence counter and retries
+// if a writer got in between.
+// Writers publish the table as view_items and view_capacity. A reader
+// loads both, checks the sequence counter before probing, and probes
+// only with its own copy, so it never mixes the fields of two tables.
+// Every shard allocates its tables on its own Arena, which is never
+// unmapped while the map lives. A resize overwrites the table retired
+// by the resize before it, never the one it retires itself, so a reader
+// still probing a dead table must have stalled across a whole table
+// lifetime, and the final sequence check rejects whatever it read there.
+// Memory stays bounded at about three times the live table, even when
+// remove/insert churn keeps rehashing at the same capacity.
+// Because get may see a half written entry before retrying, key_equal
+// must be safe to call on any bit pattern of Key (plain values, no
+// pointers to chase). psh_hash_map_def(Key, Value) must come first.
+
+#ifndef PSH_SHARDED_HASH_MAP_SHARDS
+    #define PSH_SHARDED_HASH_MAP_SHARDS 64
+#endif
+
+// Virtual memory reserved per shard, only the used part is committed
+#ifndef PSH_SHARDED_HASH_MAP_SHARD_RESERVE
+    #define PSH_SHARDED_HASH_MAP_SHARD_RESERVE GB(4)
+#endif
+
+#define Psh_ShardedHashMap(Key, Value) struct Psh_ ## Key ## _ ## Value ## _ShardedHashMap
+
+#define psh_sharded_hash_map_def(Key, Value)         \
+    Psh_ShardedHashMap(Key, Value) {                 \
+        struct {                                     \
+            alignas(64) u32 seq;                     \
+            Arena arena;                             \
+            Psh_HashMap(Key, Value) table;           \
+            Psh_HashMapEntry(Key, Value) *view_items;\
+            isize view_capacity;                     \
+        } shards[PSH_SHARDED_HASH_MAP_SHARDS];       \
+        u64 (*key_hash)(Key key);                    \
+    };
+
+static inline isize psh__sharded_hash_map_shard(u64 hash)
+{ return (isize)((hash >> 40) % PSH_SHARDED_HASH_MAP_SHARDS); }
+
+// An odd sequence number means a writer holds the shard
+static inline void psh__seqlock_lock(u32 *seq) {
+    for (u32 spins = 0;; ++spins) {
+        u32 current = __atomic_load_n(seq, __ATOMIC_RELAXED);
+        if (!(current & 1) &&
+            __atomic_compare_exchange_n(seq, &current, current + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+
+        if (spins < 64) psh__spin_pause();
+        else sched_yield();
+    }
+    // the odd number must be visible before any write to the shard
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void psh__seqlock_unlock(u32 *seq)
+{ __atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE); }
+
+static inline u32 psh__seqlock_read_begin(u32 *seq) {
+    u32 current;
+    for (u32 spins = 0; (current = __atomic_load_n(seq, __ATOMIC_ACQUIRE)) & 1; ++spins) {
+        if (spins < 64) psh__spin_pause();
+        else sched_yield();
+    }
+    return current;
+}
+
+static inline b32 psh__seqlock_read_retry(u32 *seq, u32 start) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(seq, __ATOMIC_RELAXED) != start;
+}
+
+// Called before every insert. The next table is at most twice the size of
+// the current one: it goes below the current table if it fits there,
+// otherwise right above it, over whatever dead tables are left.
+static inline void psh__sharded_hash_map_reuse(Arena *arena, void *items, isize capacity, usize entry_size) {
+    usize table_start = (byte *)items - arena->base_ptr;
+    usize table_size = (usize)capacity * (entry_size + 1) + (usize)capacity / PSH_HASH_MAP_GROUP;
+    arena->current_offset = table_start >= 2 * table_size ? 0 : table_start + table_size;
+}
+
+// Called by the writer while it holds the shard
+#define psh__sharded_hash_map_publish(shard) do {                                            \
+        __atomic_store_n(&(shard)->view_items, (shard)->table.items, __ATOMIC_RELAXED);       \
+        __atomic_store_n(&(shard)->view_capacity, (shard)->table.capacity, __ATOMIC_RELAXED); \
+    } while (0)
+
+#define psh_sharded_hash_map_init(map, hash_function, equal_function) do {                 \
+        (map)->key_hash = (hash_function);                                                  \
+        for (isize psh__s = 0; psh__s < PSH_SHARDED_HASH_MAP_SHARDS; ++psh__s) {            \
+            (map)->shards[psh__s].seq = 0;                                                  \
+            (map)->shards[psh__s].arena = arena_init(PSH_SHARDED_HASH_MAP_SHARD_RESERVE);   \
+            psh_hash_map_init_with_arena(&(map)->shards[psh__s].table,                        \
+                &(map)->shards[psh__s].arena, PSH_HASH_MAP_GROUP,                           \
+                (hash_function), (equal_function));                                         \
+            psh__sharded_hash_map_publish(&(map)->shards[psh__s]);                          \
+        }                                                                                   \
+    } while (0)
+
+// Not thread safe, no other thread may use the map anymore
+#define psh_sharded_hash_map_free(map) do {                                     \
+        for (isize psh__s = 0; psh__s < PSH_SHARDED_HASH_MAP_SHARDS; ++psh__s)  \
+            arena_destroy((map)->shards[psh__s].arena);                         \
+    } while (0)
+
+#define psh_sharded_hash_map_insert(map, new_key, new_value) do {                     \
+        u64 psh__shard_hash = psh__hash_map_mix((map)->key_hash(new_key));            \
+        isize psh__s = psh__sharded_hash_map_shard(psh__shard_hash);                  \
+        psh__seqlock_lock(&(map)->shards[psh__s].seq);                                \
+        psh__sharded_hash_map_reuse(&(map)->shards[psh__s].arena,                     \
+            (map)->shards[psh__s].table.items, (map)->shards[psh__s].table.capacity,      \
+            sizeof(*(map)->shards[psh__s].table.items));                                \
+        psh_hash_map_insert(&(map)->shards[psh__s].table, (new_key), (new_value));      \
+        psh__sharded_hash_map_publish(&(map)->shards[psh__s]);                        \
+        psh__seqlock_unlock(&(map)->shards[psh__s].seq);                              \
+    } while (0)
+
+#define psh_sharded_hash_map_remove(map, search_key) do {                             \
+        u64 psh__shard_hash = psh__hash_map_mix((map)->key_hash(search_key));         \
+        isize psh__s = psh__sharded_hash_map_shard(psh__shard_hash);                  \
+        psh__seqlock_lock(&(map)->shards[psh__s].seq);                                \
+        psh_hash_map_remove(&(map)->shards[psh__s].table, (search_key));                \
+        psh__sharded_hash_map_publish(&(map)->shards[psh__s]);                        \
+        psh__seqlock_unlock(&(map)->shards[psh__s].seq);                              \
+    } while (0)
+
+// Copies the value into *result_pointer and sets *found_pointer
+#define psh_sharded_hash_map_get(map, search_key, result_pointer, found_pointer) do {             \
+        u64 psh__shard_hash = psh__hash_map_mix((map)->key_hash(search_key));                     \
+        isize psh__s = psh__sharded_hash_map_shard(psh__shard_hash);                              \
+        u32 psh__seq;                                                                             \
+        do {                                                                                      \
+            psh__seq = psh__seqlock_read_begin(&(map)->shards[psh__s].seq);                       \
+            __typeof__((map)->shards[psh__s].view_items) psh__items =                             \
+                __atomic_load_n(&(map)->shards[psh__s].view_items, __ATOMIC_RELAXED);             \
+            isize psh__capacity = __atomic_load_n(&(map)->shards[psh__s].view_capacity, __ATOMIC_RELAXED); \
+            isize psh__found = -1;                                                                \
+            if (!psh__seqlock_read_retry(&(map)->shards[psh__s].seq, psh__seq))                   \
+                psh__hash_map_find_in(&(map)->shards[psh__s].table, psh__items,                   \
+                                      (u8 *)(psh__items + psh__capacity), psh__capacity,          \
+                                      psh__shard_hash, (search_key), psh__found);                 \
+            *(found_pointer) = psh__found >= 0;                                                   \
+            if (psh__found >= 0) *(result_pointer) = psh__items[psh__found].value;                \
+        } while (psh__seqlock_read_retry(&(map)->shards[psh__s].seq, psh__seq));                  \
+    } while (0)
+
+// sharded hash map END
+
 // unity build START
 
 typedef i32 psh_ternary;
@@ -667,6 +1699,40 @@ static Psh_CodePoint PSH_UTF8_REPLACEMENT = {
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/poll.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <signal.h>
+
+#if defined(__linux__)
+    #include <sys/epoll.h>
+    #include <sys/syscall.h>
+    #define PSH__HAS_EPOLL
+    #if defined(__has_include)
+        #if __has_include(<linux/io_uring.h>) && defined(SYS_io_uring_setup)
+            #include <linux/io_uring.h>
+            #define PSH__HAS_IO_URING
+        #endif
+    #endif
+    #if defined(SYS_pidfd_open)
+        #define PSH__HAS_PIDFD
+    #endif
+    #if defined(SYS_tee) && defined(SYS_splice)
+        #define PSH__HAS_SPLICE
+    #endif
+#endif
+
+// These are hidden behind _GNU_SOURCE in fcntl.h
+#ifdef PSH__HAS_SPLICE
+    #ifndef SPLICE_F_MOVE
+        #define SPLICE_F_MOVE 1
+    #endif
+    static inline isize psh__tee(Psh_Fd in, Psh_Fd out, usize len, u32 flags)
+    { return syscall(SYS_tee, in, out, len, flags); }
+    static inline isize psh__splice(Psh_Fd in, Psh_Fd out, usize len, u32 flags)
+    { return syscall(SYS_splice, in, NULL, out, NULL, len, flags); }
+#endif
 
 // time IMPL START
 
@@ -679,72 +1745,291 @@ u64 psh_time_now_ns(void) {
 
 // hash map IMPL START
 
-// https://www.rfc-editor.org/rfc/rfc9923.html
-u64 psh_hash_bytes(void const *data, usize size) {
-    byte const *bytes = data;
-    u64 hash = UINT64_C(14695981039346656037);
-    for (usize i = 0; i < size; ++i) {
-        hash ^= (u8)bytes[i];
-        hash *= UINT64_C(1099511628211);
-    }
-    return hash;
+// Small and medium inputs use wyhash, which folds 16 bytes per
+// 64x64->128 multiply. Inputs of PSH__HASH_BULK bytes or more use an
+// xxh3 style accumulator of 8 lanes over 64 byte stripes, which maps
+// directly onto AVX2 when the CPU has it. Both paths give the same hash.
+// https://github.com/wangyi-fudan/wyhash
+// https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md
+#define PSH__HASH_BULK 512
+#define PSH__HASH_STRIPE 64
+#define PSH__HASH_BLOCK_STRIPES 16
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+    #include <immintrin.h>
+    #define PSH__HASH_HAS_AVX2
+#endif
+
+static u64 const psh__hash_secret[32] = {
+    UINT64_C(0x0bd2db2e48789d20), UINT64_C(0x7c621bc543b550a8), UINT64_C(0xb27410639e13de46), UINT64_C(0xd3c4eb1714b569e5),
+    UINT64_C(0x9fc8be2266edda39), UINT64_C(0x491e4aceebe4be30), UINT64_C(0x180afb1a9570beb0), UINT64_C(0xca454537878d2950),
+    UINT64_C(0xa96a98c828045478), UINT64_C(0xa4a4b920c8e15bf5), UINT64_C(0xae09d92fba683111), UINT64_C(0x1defe04876a32064),
+    UINT64_C(0x1b830cede5f3a95f), UINT64_C(0x5d45a31f3dd3297f), UINT64_C(0x1b37fd03b9ada18e), UINT64_C(0xa9cad3754033f149),
+    UINT64_C(0x2bbe59b3c2df09d1), UINT64_C(0xc01f604b97fba984), UINT64_C(0xdad0325410c910f5), UINT64_C(0x0677e5dd8bdbadf9),
+    UINT64_C(0x2bc9abfd44bc3b36), UINT64_C(0x08cf102312742cef), UINT64_C(0x495cf4650c95833d), UINT64_C(0x288961efe041bc37),
+    UINT64_C(0x98ed752e258e01f9), UINT64_C(0xc52d415200f3564b), UINT64_C(0xcdd458acbdd6c870), UINT64_C(0x566084b17ea38725),
+    UINT64_C(0xe7542a38b9d1fea3), UINT64_C(0xdd9d16547d375b50), UINT64_C(0x96ba0d35cbccf939), UINT64_C(0x9da04ee13d14edb1),
+};
+
+#define PSH__HASH_P0 UINT64_C(0xa0761d6478bd642f)
+#define PSH__HASH_P1 UINT64_C(0xe7037ed1a0b428db)
+#define PSH__HASH_P2 UINT64_C(0x8ebc6af09c88c6e3)
+#define PSH__HASH_P3 UINT64_C(0x589965cc75374cc3)
+#define PSH__HASH_PRIME32 UINT64_C(0x9e3779b1)
+
+static inline u64 psh__hash_read64(byte const *p) { u64 v; memcpy(&v, p, sizeof(v)); return v; }
+static inline u64 psh__hash_read32(byte const *p) { u32 v; memcpy(&v, p, sizeof(v)); return v; }
+
+static inline void psh__hash_mum(u64 *a, u64 *b) {
+    __uint128_t r = (__uint128_t)*a * *b;
+    *a = (u64)r;
+    *b = (u64)(r >> 64);
 }
 
-void *psh__hash_map_resize(void *items, isize old_capacity, isize new_capacity, usize entry_size) {
-    byte *new_items = PSH_HASH_MAP_REALLOC(NULL, (usize)new_capacity * entry_size);
-    PSH_ASSERT(new_items != NULL && "Could not allocate hash map");
-    memset(new_items, 0, (usize)new_capacity * entry_size);
-
-    byte *old_items = items;
-    for (isize i = 0; i < old_capacity; ++i) {
-        byte *old_entry = old_items + (usize)i * entry_size;
-        Psh_HashMapEntryHeader header;
-        memcpy(&header, old_entry, sizeof(header));
-        if (header.state != PSH_HASH_MAP_ENTRY_OCCUPIED) continue;
-
-        isize index = psh__hash_map_index(header.hash, new_capacity);
-        isize step = psh__hash_map_step(header.hash, new_capacity);
-        for (isize probe = 0; probe < new_capacity; ++probe) {
-            byte *new_entry = new_items + (usize)index * entry_size;
-            Psh_HashMapEntryHeader new_header;
-            memcpy(&new_header, new_entry, sizeof(new_header));
-            if (new_header.state == PSH_HASH_MAP_ENTRY_EMPTY) {
-                memcpy(new_entry, old_entry, entry_size);
-                break;
-            }
-            index = (index + step) & (new_capacity - 1);
+static inline u64 psh__hash_mix(u64 a, u64 b) {
+    psh__hash_mum(&a, &b);
+    return a ^ b;
+}
+
+static inline u64 psh__hash_small(byte const *p, usize size) {
+    u64 seed = psh__hash_mix(PSH__HASH_P0, PSH__HASH_P1);
+    u64 a, b;
+    if (size <= 16) {
+        if (size >= 4) {
+            a = (psh__hash_read32(p) << 32) | psh__hash_read32(p + ((size >> 3) << 2));
+            b = (psh__hash_read32(p + size - 4) << 32) | psh__hash_read32(p + size - 4 - ((size >> 3) << 2));
+        } else if (size > 0) {
+            a = ((u64)(u8)p[0] << 16) | ((u64)(u8)p[size >> 1] << 8) | (u8)p[size - 1];
+            b = 0;
+        } else {
+            a = b = 0;
         }
+    } else {
+        usize i = size;
+        if (i > 48) {
+            u64 see1 = seed, see2 = seed;
+            do {
+                seed = psh__hash_mix(psh__hash_read64(p) ^ PSH__HASH_P1, psh__hash_read64(p + 8) ^ seed);
+                see1 = psh__hash_mix(psh__hash_read64(p + 16) ^ PSH__HASH_P2, psh__hash_read64(p + 24) ^ see1);
+                see2 = psh__hash_mix(psh__hash_read64(p + 32) ^ PSH__HASH_P3, psh__hash_read64(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = psh__hash_mix(psh__hash_read64(p) ^ PSH__HASH_P1, psh__hash_read64(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        a = psh__hash_read64(p + i - 16);
+        b = psh__hash_read64(p + i - 8);
     }
 
-    PSH_HASH_MAP_FREE(items);
-    return new_items;
+    a ^= PSH__HASH_P1;
+    b ^= seed;
+    psh__hash_mum(&a, &b);
+    return psh__hash_mix(a ^ PSH__HASH_P0 ^ size, b ^ PSH__HASH_P1);
 }
 
-// hash map IMPL END
+static inline void psh__hash_stripe(u64 *acc, byte const *p, u64 const *secret) {
+    for (usize i = 0; i < 8; ++i) {
+        u64 data = psh__hash_read64(p + 8 * i);
+        u64 keyed = data ^ secret[i];
+        acc[i ^ 1] += data;
+        acc[i] += (keyed & 0xffffffff) * (keyed >> 32);
+    }
+}
 
-// psh_logger impl START
+static inline void psh__hash_scramble(u64 *acc) {
+    for (usize i = 0; i < 8; ++i) {
+        acc[i] ^= acc[i] >> 47;
+        acc[i] ^= psh__hash_secret[24 + i];
+        acc[i] *= PSH__HASH_PRIME32;
+    }
+}
 
-void psh_logger(Psh_Log_Level level, byte *fmt, ...)
-{
-    switch (level) {
-        case PSH_INFO:
-            fprintf(stderr, "[INFO] ");
-            break;
-        case PSH_WARNING:
-            fprintf(stderr, "[WARNING] ");
-            break;
-        case PSH_ERROR:
-            fprintf(stderr, "[ERROR] ");
-            break;
-        case PSH_NO_LOGS: return;
-        default:
-            PSH_UNREACHABLE("psh_logger");
+// Whole blocks, then the remaining whole stripes,
+// then the last 64 bytes which may overlap them
+static inline void psh__hash_accumulate(u64 *acc, byte const *p, usize size) {
+    usize block_size = PSH__HASH_STRIPE * PSH__HASH_BLOCK_STRIPES;
+    usize blocks = (size - 1) / block_size;
+    byte const *tail = p + blocks * block_size;
+    for (; p < tail; p += block_size) {
+        for (usize n = 0; n < PSH__HASH_BLOCK_STRIPES; ++n)
+            psh__hash_stripe(acc, p + n * PSH__HASH_STRIPE, psh__hash_secret + n);
+        psh__hash_scramble(acc);
     }
 
-    va_list args;
-    va_start(args, fmt);
-    vfprintf(stderr, fmt, args);
-    va_end(args);
+    usize left = size - blocks * block_size;
+    for (usize n = 0; (n + 1) * PSH__HASH_STRIPE < left; ++n)
+        psh__hash_stripe(acc, tail + n * PSH__HASH_STRIPE, psh__hash_secret + n);
+    psh__hash_stripe(acc, tail + left - PSH__HASH_STRIPE, psh__hash_secret + 17);
+}
+
+#ifdef PSH__HASH_HAS_AVX2
+typedef struct { __m256i lo, hi; } Psh__Hash_Acc_Avx2;
+
+__attribute__((target("avx2")))
+static inline void psh__hash_stripe_avx2(Psh__Hash_Acc_Avx2 *acc, byte const *p, u64 const *secret) {
+    __m256i data_lo = _mm256_loadu_si256((__m256i const *)p);
+    __m256i data_hi = _mm256_loadu_si256((__m256i const *)(p + 32));
+    __m256i keyed_lo = _mm256_xor_si256(data_lo, _mm256_loadu_si256((__m256i const *)secret));
+    __m256i keyed_hi = _mm256_xor_si256(data_hi, _mm256_loadu_si256((__m256i const *)(secret + 4)));
+    // acc[i ^ 1] += data swaps neighbouring lanes
+    acc->lo = _mm256_add_epi64(acc->lo, _mm256_shuffle_epi32(data_lo, _MM_SHUFFLE(1, 0, 3, 2)));
+    acc->hi = _mm256_add_epi64(acc->hi, _mm256_shuffle_epi32(data_hi, _MM_SHUFFLE(1, 0, 3, 2)));
+    acc->lo = _mm256_add_epi64(acc->lo, _mm256_mul_epu32(keyed_lo, _mm256_srli_epi64(keyed_lo, 32)));
+    acc->hi = _mm256_add_epi64(acc->hi, _mm256_mul_epu32(keyed_hi, _mm256_srli_epi64(keyed_hi, 32)));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i psh__hash_scramble_avx2(__m256i acc, u64 const *secret) {
+    __m256i prime = _mm256_set1_epi32((i32)PSH__HASH_PRIME32);
+    acc = _mm256_xor_si256(acc, _mm256_srli_epi64(acc, 47));
+    acc = _mm256_xor_si256(acc, _mm256_loadu_si256((__m256i const *)secret));
+    __m256i product_lo = _mm256_mul_epu32(acc, prime);
+    __m256i product_hi = _mm256_mul_epu32(_mm256_srli_epi64(acc, 32), prime);
+    return _mm256_add_epi64(product_lo, _mm256_slli_epi64(product_hi, 32));
+}
+
+__attribute__((target("avx2")))
+static void psh__hash_accumulate_avx2(u64 *acc_out, byte const *p, usize size) {
+    Psh__Hash_Acc_Avx2 acc = {
+        _mm256_loadu_si256((__m256i const *)acc_out),
+        _mm256_loadu_si256((__m256i const *)(acc_out + 4)),
+    };
+
+    usize block_size = PSH__HASH_STRIPE * PSH__HASH_BLOCK_STRIPES;
+    usize blocks = (size - 1) / block_size;
+    byte const *tail = p + blocks * block_size;
+    for (; p < tail; p += block_size) {
+        for (usize n = 0; n < PSH__HASH_BLOCK_STRIPES; ++n)
+            psh__hash_stripe_avx2(&acc, p + n * PSH__HASH_STRIPE, psh__hash_secret + n);
+        acc.lo = psh__hash_scramble_avx2(acc.lo, psh__hash_secret + 24);
+        acc.hi = psh__hash_scramble_avx2(acc.hi, psh__hash_secret + 28);
+    }
+
+    usize left = size - blocks * block_size;
+    for (usize n = 0; (n + 1) * PSH__HASH_STRIPE < left; ++n)
+        psh__hash_stripe_avx2(&acc, tail + n * PSH__HASH_STRIPE, psh__hash_secret + n);
+    psh__hash_stripe_avx2(&acc, tail + left - PSH__HASH_STRIPE, psh__hash_secret + 17);
+
+    _mm256_storeu_si256((__m256i *)acc_out, acc.lo);
+    _mm256_storeu_si256((__m256i *)(acc_out + 4), acc.hi);
+}
+#endif
+
+static inline u64 psh__hash_bulk(byte const *p, usize size) {
+    u64 acc[8] = {
+        PSH__HASH_PRIME32, PSH__HASH_P0, PSH__HASH_P1, PSH__HASH_P2,
+        PSH__HASH_P3, PSH__HASH_P0 ^ PSH__HASH_P1, PSH__HASH_P2 ^ PSH__HASH_P3, PSH__HASH_PRIME32 << 32,
+    };
+
+#ifdef PSH__HASH_HAS_AVX2
+    if (__builtin_cpu_supports("avx2")) psh__hash_accumulate_avx2(acc, p, size);
+    else
+#endif
+    psh__hash_accumulate(acc, p, size);
+
+    u64 result = size * PSH__HASH_P0;
+    for (usize i = 0; i < 8; i += 2)
+        result += psh__hash_mix(acc[i] ^ psh__hash_secret[16 + i], acc[i + 1] ^ psh__hash_secret[17 + i]);
+    return psh__hash_mix(result ^ PSH__HASH_P2, result >> 32 ^ PSH__HASH_P3);
+}
+
+u64 psh_hash_bytes(void const *data, usize size) {
+    if (size < PSH__HASH_BULK) return psh__hash_small(data, size);
+    return psh__hash_bulk(data, size);
+}
+
+void *psh__hash_map_alloc(Arena *arena, isize capacity, usize entry_size) {
+    usize size = (usize)capacity * (entry_size + 1) + (usize)capacity / PSH_HASH_MAP_GROUP;
+    byte *items = arena
+        ? arena_push_(arena, size, alignof_type(max_align_t), 1)
+        : PSH_HASH_MAP_REALLOC(NULL, size);
+    PSH_ASSERT(items != NULL && "Could not allocate hash map");
+    psh__hash_map_reset((u8 *)items + (usize)capacity * entry_size, capacity);
+    return items;
+}
+
+isize psh__hash_map_fit(usize memory_size, usize entry_size) {
+    isize capacity = 0;
+    for (isize c = PSH_HASH_MAP_GROUP; (usize)c * (entry_size + 1) + (usize)c / PSH_HASH_MAP_GROUP <= memory_size; c *= 2)
+        capacity = c;
+    return capacity;
+}
+
+// The overflow bytes directly follow the control bytes
+void psh__hash_map_reset(u8 *ctrl, isize capacity) {
+    memset(ctrl, PSH_HASH_MAP_CTRL_EMPTY, (usize)capacity);
+    memset(ctrl + capacity, 0, (usize)capacity / PSH_HASH_MAP_GROUP);
+}
+
+// Index of the first used slot, -1 if there is none
+isize psh__hash_map_first(u8 const *ctrl, isize capacity) {
+    for (isize i = 0; i < capacity; ++i)
+        if (ctrl[i] != PSH_HASH_MAP_CTRL_EMPTY) return i;
+    return -1;
+}
+
+// Takes the first empty slot on the probe sequence of hash
+// and marks every full group it passes as overflowed
+isize psh__hash_map_claim(u8 *ctrl, u8 *overflow, isize capacity, u64 hash) {
+    Psh__HashMapProbe probe = psh__hash_map_probe(hash, capacity);
+    for (isize i = 0; i < capacity / PSH_HASH_MAP_GROUP; ++i) {
+        isize base = probe.group * PSH_HASH_MAP_GROUP;
+        u64 empty = psh__hash_map_match(ctrl + base, PSH_HASH_MAP_CTRL_EMPTY);
+        if (empty) {
+            isize slot = base + psh__hash_map_match_slot(empty);
+            ctrl[slot] = psh__hash_map_tag(hash);
+            return slot;
+        }
+
+        overflow[probe.group] |= psh__hash_map_overflow_bit(hash);
+        probe.step++;
+        probe.group = (probe.group + probe.step) & probe.group_mask;
+    }
+
+    return -1;
+}
+
+// hash map IMPL END
+
+// seg list IMPL START
+
+void *psh__seg_list_alloc(Arena *arena, usize size) {
+    void *segment = arena
+        ? arena_push_(arena, size, alignof_type(max_align_t), 1)
+        : PSH_LIST_REALLOC(NULL, size);
+    PSH_ASSERT(segment != NULL && "Buy more RAM lol");
+    return segment;
+}
+// seg list IMPL END
+
+// psh_logger impl START
+
+void psh_logger(Psh_Log_Level level, byte *fmt, ...)
+{
+    switch (level) {
+        case PSH_INFO:
+            fprintf(stderr, "[INFO] ");
+            break;
+        case PSH_WARNING:
+            fprintf(stderr, "[WARNING] ");
+            break;
+        case PSH_ERROR:
+            fprintf(stderr, "[ERROR] ");
+            break;
+        case PSH_NO_LOGS: return;
+        default:
+            PSH_UNREACHABLE("psh_logger");
+    }
+
+    va_list args;
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
     fprintf(stderr, "\n");
 }
 // psh_logger impl END
@@ -788,17 +2073,67 @@ void psh_fd_close_safe(Psh_Fd fd) {
 b32 psh_fd_not_default(Psh_Fd fd) {
     return fd > STDERR_FILENO;
 }
+
+psh_s8 psh_file_map_opt(byte *path, Psh_File_Map_Opt opt) {
+    psh_s8 view = {0};
+    // O_NONBLOCK so a FIFO fails the check below instead of blocking
+    // in open until a writer shows up
+    Psh_Fd fd = psh_fd_open(path, O_RDONLY | O_NONBLOCK, 0);
+    if (fd < 0) return view;
+
+    struct stat statbuf;
+    if (fstat(fd, &statbuf) < 0) {
+        psh_logger(PSH_ERROR, "Could not stat file %s: %s", path, strerror(errno));
+        psh_fd_close(fd);
+        return view;
+    }
+
+    if (!S_ISREG(statbuf.st_mode)) {
+        psh_logger(PSH_ERROR, "Could not map %s: not a regular file", path);
+        psh_fd_close(fd);
+        return view;
+    }
+
+    // mmap refuses zero length
+    if (statbuf.st_size == 0) {
+        psh_fd_close(fd);
+        return psh_s8("");
+    }
+
+    i32 flags = MAP_PRIVATE | (opt.populate ? MAP_POPULATE : 0);
+    byte *data = mmap(NULL, statbuf.st_size, PROT_READ, flags, fd, 0);
+    // The mapping keeps the file alive
+    psh_fd_close(fd);
+    if (data == MAP_FAILED) {
+        psh_logger(PSH_ERROR, "Could not map file %s: %s", path, strerror(errno));
+        return view;
+    }
+
+    if (opt.sequential) madvise(data, statbuf.st_size, MADV_SEQUENTIAL);
+    if (opt.willneed) madvise(data, statbuf.st_size, MADV_WILLNEED);
+
+    return psh_s8(data, statbuf.st_size);
+}
+
+void psh_file_unmap(psh_s8 view) {
+    if (view.len > 0) munmap(view.s, view.len);
+}
 // fd IMPL END
 
 // cmd IMPL START
 
-static inline Psh_Proc psh__cmd_start_proc(Psh_Cmd cmd, Psh_Fd fdin, Psh_Fd fdout, Psh_Fd fderr);
+static inline Psh_Proc psh__cmd_start_proc(Psh_Cmd *cmd, Psh_Cmd_Opt opt);
+static inline Psh_Proc psh__cmd_fork_proc(Psh_Cmd *cmd, Psh_Fd fdin, Psh_Fd fdout, Psh_Fd fderr);
+static inline Psh_Proc psh__cmd_spawn_proc(Psh_Cmd *cmd, Psh_Fd fdin, Psh_Fd fdout, Psh_Fd fderr);
+static inline Psh_Proc psh__cmd_tap_proc(Psh_Unix_Pipe tap_pipe, Psh_Fd out, Psh_Fd tap);
 static inline b32 psh__block_unwanted_procs(Psh_Procs *async, u8 max_procs);
 static inline void psh__setup_child_io(Psh_Fd fdin, Psh_Fd fdout, Psh_Fd fderr);
 static inline b32 psh__proc_wait(Psh_Proc pid);
-static inline i32 psh__proc_wait_async(Psh_Proc pid);
-static inline b32 psh__procs_wait(Psh_Procs procs);
+static inline void psh__procs_watch(Psh_Procs *procs);
+static inline void psh__procs_clamp(Psh_Procs *procs);
+static inline b32 psh__proc_status_check(Psh_Proc_Status status);
 static inline void psh__cmd_build_cstr(Psh_Cmd cmd, Psh_Sb *sb);
+static inline void psh__cmd_opt_close_fds(Psh_Cmd_Opt opt);
 static inline i32 psh__nprocs(void);
 
 b32 psh_cmd_run_opt(Psh_Cmd *cmd, Psh_Cmd_Opt opt) {
@@ -808,23 +2143,52 @@ b32 psh_cmd_run_opt(Psh_Cmd *cmd, Psh_Cmd_Opt opt) {
     if (opt.fdout == PSH_INVALID_FD) psh_return_defer(false);
     if (opt.fderr == PSH_INVALID_FD) psh_return_defer(false);
 
+    b32 has_tap = opt.tap != PSH_INVALID_FD;
     u8 max_procs = opt.max_procs > 0 ? opt.max_procs : psh__nprocs() + 1;
     if (opt.async) {
-        if (!psh__block_unwanted_procs(opt.async, max_procs)) psh_return_defer(false);
+        // the tap helper takes a slot of its own
+        u8 slots = has_tap && max_procs > 1 ? max_procs - 1 : max_procs;
+        if (!psh__block_unwanted_procs(opt.async, slots)) psh_return_defer(false);
+    }
+
+    // With a tap stdout goes through a helper proc that
+    // copies it into both opt.fdout and opt.tap
+    Psh_Cmd_Opt proc_opt = opt;
+    Psh_Proc tap_pid = PSH_INVALID_PROC;
+    if (has_tap) {
+        Psh_Unix_Pipe tap_pipe;
+        if (!psh_pipe_open(&tap_pipe)) psh_return_defer(false);
+
+        tap_pid = psh__cmd_tap_proc(tap_pipe, opt.fdout, opt.tap);
+        psh_fd_close(tap_pipe.read_fd);
+        if (tap_pid == PSH_INVALID_PROC) {
+            psh_fd_close(tap_pipe.write_fd);
+            psh_return_defer(false);
+        }
+
+        proc_opt.fdout = tap_pipe.write_fd;
     }
 
-    Psh_Proc pid = psh__cmd_start_proc(*cmd, opt.fdin, opt.fdout, opt.fderr);
-    if (pid == PSH_INVALID_PROC) psh_return_defer(false);
+    Psh_Proc pid = psh__cmd_start_proc(cmd, proc_opt);
+    // the helper sees EOF once the proc is done with its stdout
+    if (tap_pid != PSH_INVALID_PROC) psh_fd_close(proc_opt.fdout);
+
+    if (pid == PSH_INVALID_PROC) {
+        if (tap_pid != PSH_INVALID_PROC) psh__proc_wait(tap_pid);
+        psh_return_defer(false);
+    }
 
-    if (opt.async)
+    if (opt.async) {
         psh_list_append(opt.async, pid);
-    else
+        if (tap_pid != PSH_INVALID_PROC) psh_list_append(opt.async, tap_pid);
+        psh__procs_watch(opt.async);
+    } else {
         result = psh__proc_wait(pid);
+        if (tap_pid != PSH_INVALID_PROC && !psh__proc_wait(tap_pid)) result = false;
+    }
 
 defer:
-    if (!opt.keep_fdin_open)  psh_fd_close_safe(opt.fdin);
-    if (!opt.keep_fdout_open) psh_fd_close_safe(opt.fdout);
-    if (!opt.keep_fderr_open) psh_fd_close_safe(opt.fderr);
+    psh__cmd_opt_close_fds(opt);
 
     cmd->count = 0;
 
@@ -832,25 +2196,52 @@ defer:
 }
 
 b32 psh_procs_block(Psh_Procs *procs) {
-    b32 result = psh__procs_wait(*procs);
-    procs->count = 0;
+    b32 result = true;
+    while (procs->count > 0) {
+        Psh_Proc_Status status;
+        if (!psh_procs_wait_any(procs, &status)) return false;
+        // keep waiting so that an early failure is not
+        // masked and no child is left unreaped
+        if (!psh__proc_status_check(status)) result = false;
+    }
     return result;
 }
 
-static inline Psh_Proc psh__cmd_start_proc(Psh_Cmd cmd, Psh_Fd fdin, Psh_Fd fdout, Psh_Fd fderr) {
+static inline Psh_Proc psh__cmd_start_proc(Psh_Cmd *cmd, Psh_Cmd_Opt opt) {
     
-    if (cmd.count < 1) {
+    if (cmd->count < 1) {
         psh_logger(PSH_ERROR, "Cannot run an empty command");
         return PSH_INVALID_PROC;
     }
 
 #ifndef PSH_NO_ECHO
     Psh_Sb sb = {0};
-    psh__cmd_build_cstr(cmd, &sb);
+    psh__cmd_build_cstr(*cmd, &sb);
     psh_logger(PSH_INFO, "CMD: %s", sb.items);
     psh_list_free(sb);
 #endif
 
+    // execvp needs a NULL terminated argv. Terminate in
+    // the parent so that no backend allocates in the child.
+    psh_list_reserve(cmd, cmd->count + 1);
+    cmd->items[cmd->count] = NULL;
+
+    Psh_Spawn_Backend backend = opt.spawn != PSH_SPAWN_DEFAULT
+        ? opt.spawn
+        : PSH_SPAWN_DEFAULT_BACKEND;
+
+    switch (backend) {
+        case PSH_SPAWN_POSIX:
+            return psh__cmd_spawn_proc(cmd, opt.fdin, opt.fdout, opt.fderr);
+        case PSH_SPAWN_DEFAULT:
+        case PSH_SPAWN_FORK:
+            return psh__cmd_fork_proc(cmd, opt.fdin, opt.fdout, opt.fderr);
+        default:
+            PSH_UNREACHABLE("psh__cmd_start_proc");
+    }
+}
+
+static inline Psh_Proc psh__cmd_fork_proc(Psh_Cmd *cmd, Psh_Fd fdin, Psh_Fd fdout, Psh_Fd fderr) {
     Psh_Proc cpid = fork();
     if (cpid < 0) {
         psh_logger(PSH_ERROR, "Could not fork a child process: %s", strerror(errno));
@@ -860,13 +2251,58 @@ static inline Psh_Proc psh__cmd_start_proc(Psh_Cmd cmd, Psh_Fd fdin, Psh_Fd fdou
     if (cpid == 0) {
         psh__setup_child_io(fdin, fdout, fderr);
 
-        psh_cmd_append(&cmd, NULL);
-        execvp(cmd.items[0], cmd.items);
+        execvp(cmd->items[0], cmd->items);
 
-        psh_logger(PSH_ERROR, "Could not exec in child process for '%s': %s", cmd.items[0], strerror(errno));
+        psh_logger(PSH_ERROR, "Could not exec in child process for '%s': %s", cmd->items[0], strerror(errno));
         exit(EXIT_FAILURE);
 
-        PSH_UNREACHABLE("psh__cmd_start_proc");
+        PSH_UNREACHABLE("psh__cmd_fork_proc");
+    }
+
+    return cpid;
+}
+
+extern char **environ;
+
+static inline i32 psh__spawn_add_dup2(posix_spawn_file_actions_t *actions, Psh_Fd fd, Psh_Fd target) {
+    // dup2 onto itself is a no-op in the fork path, keep it that way
+    if (fd == target) return 0;
+    return posix_spawn_file_actions_adddup2(actions, fd, target);
+}
+
+// Mirrors psh__cmd_fork_proc, but sets up child io through file
+// actions. Falls back to fork whenever the request cannot be
+// expressed with posix_spawn on this system.
+static inline Psh_Proc psh__cmd_spawn_proc(Psh_Cmd *cmd, Psh_Fd fdin, Psh_Fd fdout, Psh_Fd fderr) {
+    posix_spawn_file_actions_t actions;
+    i32 err = posix_spawn_file_actions_init(&actions);
+    if (err != 0) {
+        psh_logger(PSH_WARNING, "Could not init spawn file actions, falling back to fork: %s", strerror(err));
+        return psh__cmd_fork_proc(cmd, fdin, fdout, fderr);
+    }
+
+    // Same order as psh__setup_child_io
+    if ((err = psh__spawn_add_dup2(&actions, fdin,  STDIN_FILENO))  != 0 ||
+        (err = psh__spawn_add_dup2(&actions, fdout, STDOUT_FILENO)) != 0 ||
+        (err = psh__spawn_add_dup2(&actions, fderr, STDERR_FILENO)) != 0)
+    {
+        posix_spawn_file_actions_destroy(&actions);
+        psh_logger(PSH_WARNING, "Could not setup child io for spawn, falling back to fork: %s", strerror(err));
+        return psh__cmd_fork_proc(cmd, fdin, fdout, fderr);
+    }
+
+    Psh_Proc cpid;
+    err = posix_spawnp(&cpid, cmd->items[0], &actions, NULL, cmd->items, environ);
+    posix_spawn_file_actions_destroy(&actions);
+
+    if (err == ENOSYS) {
+        psh_logger(PSH_WARNING, "posix_spawn is not supported, falling back to fork");
+        return psh__cmd_fork_proc(cmd, fdin, fdout, fderr);
+    }
+
+    if (err != 0) {
+        psh_logger(PSH_ERROR, "Could not spawn a child process for '%s': %s", cmd->items[0], strerror(err));
+        return PSH_INVALID_PROC;
     }
 
     return cpid;
@@ -891,27 +2327,11 @@ static inline void psh__setup_child_io(Psh_Fd fdin, Psh_Fd fdout, Psh_Fd fderr)
 }
 
 static inline b32 psh__block_unwanted_procs(Psh_Procs *async, u8 max_procs) {
-    // while loop blocks until the allowed
-    // amount of procs is left running
+    // blocks until the allowed amount of procs is left running
     while (async->count >= max_procs) {
-        for (usize i = 0; i < async->count; ) {
-            i32 ret = psh__proc_wait_async(async->items[i]);
-            if (ret < 0) 
-                return false;
-            if (ret) {
-                psh_list_remove_unordered(async, i);
-            } else {
-                #define SLEEP_MS 1
-                #define SLEEP_NS SLEEP_MS * 1000 * 1000
-                static struct timespec duration = {
-                    .tv_sec = SLEEP_NS / (1000*1000*1000),
-                    .tv_nsec = SLEEP_NS % (1000*1000*1000),
-                };
-
-                nanosleep(&duration, NULL);
-                ++i;
-            }
-        }
+        Psh_Proc_Status status;
+        if (!psh_procs_wait_any(async, &status)) return false;
+        if (!psh__proc_status_check(status)) return false;
     }
     return true;
 }
@@ -951,157 +2371,680 @@ static inline b32 psh__proc_wait(Psh_Proc pid) {
     PSH_UNREACHABLE("psh__proc_wait");
 }
 
-static inline i32 psh__proc_wait_async(Psh_Proc pid) {
-    i32 wstatus;
+static inline b32 psh__fd_is_pipe(Psh_Fd fd) {
+    struct stat statbuf;
+    return fstat(fd, &statbuf) == 0 && S_ISFIFO(statbuf.st_mode);
+}
 
-    Psh_Proc ret = waitpid(pid, &wstatus, WUNTRACED | WNOHANG);
-    if (ret < 0) {
-        // Interrupted by signal, will be retried later 
-        if (errno == EINTR) 
-            return 0;
-        psh_logger(PSH_ERROR, "could not wait on command (pid %d): %s", pid, strerror(errno));
-        return -1;
+static inline b32 psh__fd_write_all(Psh_Fd fd, byte *buf, usize size) {
+    while (size > 0) {
+        isize n = write(fd, buf, size);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        buf += n;
+        size -= n;
     }
+    return true;
+}
 
-    // With WNOHANG if waitpid returns 0, the process has 
-    // not yet finished running. Retry later.
-    if (ret == 0) return 0;
+#define PSH__TAP_CHUNK KB(64)
 
-    if (WIFEXITED(wstatus)) {
-        i32 exit_status = WEXITSTATUS(wstatus);
-        if (exit_status != EXIT_SUCCESS) {
-            psh_logger(PSH_ERROR, "command exited with exit code %d", exit_status);
-            return -1;
+// Moves everything from the in pipe into both out and tap. Data is
+// duplicated with tee into whichever of them is a pipe and moved
+// into the other one with splice, so it never enters userspace.
+// Falls back to read/write where the kernel refuses either.
+static inline b32 psh__tap_loop(Psh_Fd in, Psh_Fd out, Psh_Fd tap) {
+    byte buffer[PSH__TAP_CHUNK];
+
+#ifdef PSH__HAS_SPLICE
+    Psh_Fd dup_fd  = psh__fd_is_pipe(out) ? out : tap;
+    Psh_Fd move_fd = dup_fd == out ? tap : out;
+    b32 can_move = true;
+
+    while (psh__fd_is_pipe(dup_fd)) {
+        isize n = psh__tee(in, dup_fd, PSH__TAP_CHUNK, 0);
+        if (n == 0) return true;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EINVAL) break;
+            return false;
         }
 
-        return 1;
-    }
+        while (n > 0) {
+            isize moved = can_move
+                ? psh__splice(in, move_fd, n, SPLICE_F_MOVE)
+                : -1;
 
-    if (WIFSIGNALED(wstatus)) {
-        psh_logger(PSH_ERROR, "command process was terminated by signal %d", WTERMSIG(wstatus));
-        return -1;
+            // e.g. files opened with O_APPEND
+            if (moved < 0 && (!can_move || errno == EINVAL)) {
+                can_move = false;
+                moved = read(in, buffer, MIN((usize)n, sizeof buffer));
+                if (moved > 0 && !psh__fd_write_all(move_fd, buffer, moved)) return false;
+            }
+
+            if (moved < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            n -= moved;
+        }
     }
+#endif
 
-    if (WIFSTOPPED(wstatus)) {
-        psh_logger(PSH_ERROR, "command process was stopped by signal %d", WSTOPSIG(wstatus));
-        return -1;
+    isize n;
+    while ((n = read(in, buffer, sizeof buffer)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        if (!psh__fd_write_all(out, buffer, n)) return false;
+        if (!psh__fd_write_all(tap, buffer, n)) return false;
     }
+    return true;
+}
 
-    PSH_UNREACHABLE("psh__proc_wait_async");
+// Closes every fd from first up to and including last
+static inline void psh__close_fd_range(Psh_Fd first, Psh_Fd last) {
+    if (first > last) return;
+#ifdef SYS_close_range
+    if (syscall(SYS_close_range, (u32)first, (u32)last, 0) == 0) return;
+#endif
+    Psh_Fd max_fd = sysconf(_SC_OPEN_MAX) > 0 ? sysconf(_SC_OPEN_MAX) - 1 : 1023;
+    for (Psh_Fd fd = first; fd <= MIN(last, max_fd); ++fd) close(fd);
 }
 
-static inline b32 psh__procs_wait(Psh_Procs procs) {
-    b32 result = true;
-    for (usize i = 0; i < procs.count; ++i) {
-        result = psh__proc_wait(procs.items[i]);
+// The helper is a fork that never execs, so it starts out with every
+// fd of the parent, close on exec or not. Any of them may be the write
+// end of a pipe someone is waiting on for EOF, so everything but the
+// three fds it works with and stderr for the logger is closed.
+static inline void psh__tap_close_other_fds(Psh_Fd in, Psh_Fd out, Psh_Fd tap) {
+    Psh_Fd keep[] = {STDERR_FILENO, in, out, tap};
+    for (usize i = 1; i < psh_countof(keep); ++i) {
+        for (usize j = i; j > 0 && keep[j - 1] > keep[j]; --j) {
+            Psh_Fd t = keep[j];
+            keep[j] = keep[j - 1];
+            keep[j - 1] = t;
+        }
     }
-    return result;
-}
 
-static inline void psh__cmd_build_cstr(Psh_Cmd cmd, Psh_Sb *sb) {
-    for (usize i = 0; i < cmd.count; ++i) {
-        byte *arg = cmd.items[i];
-        if (arg == NULL) return;
-        if (i > 0) psh_sb_append(sb, ' ');
-        psh_sb_append_cstr(sb, arg);
+    Psh_Fd first = 0;
+    for (usize i = 0; i < psh_countof(keep); ++i) {
+        psh__close_fd_range(first, keep[i] - 1);
+        first = MAX(first, keep[i] + 1);
     }
-    psh_sb_append_null(sb);
+    psh__close_fd_range(first, INT_MAX);
 }
 
-static inline i32 psh__nprocs(void) {
-    return sysconf(_SC_NPROCESSORS_ONLN);
-}
-// cmd IMPL END
+// Always a fork, also with PSH_SPAWN_POSIX: the helper runs
+// psh__tap_loop and has nothing to exec
+static inline Psh_Proc psh__cmd_tap_proc(Psh_Unix_Pipe tap_pipe, Psh_Fd out, Psh_Fd tap) {
+    Psh_Proc cpid = fork();
+    if (cpid < 0) {
+        psh_logger(PSH_ERROR, "Could not fork a tap process: %s", strerror(errno));
+        return PSH_INVALID_PROC;
+    }
 
-// pipeline IMPL START
+    if (cpid == 0) {
+        psh__tap_close_other_fds(tap_pipe.read_fd, out, tap);
+        if (!psh__tap_loop(tap_pipe.read_fd, out, tap)) {
+            psh_logger(PSH_ERROR, "Could not tap fd(%d): %s", tap_pipe.read_fd, strerror(errno));
+            _exit(EXIT_FAILURE);
+        }
+        _exit(EXIT_SUCCESS);
+    }
 
-static inline void psh__pipeline_setup_opt(Psh_Cmd_Opt *prev_cmd_opt, 
-    Psh_Pipeline_Opt p_opt, Psh_Fd p_fdin, Psh_Fd p_fdout);
+    return cpid;
+}
 
-b32 psh_pipeline_chain_opt(Psh_Pipeline *p, Psh_Cmd *new_cmd, Psh_Cmd_Opt new_cmd_opt) {
-    if (p->error) return false;
+// Starts tracking items[watches.count..count). Procs launched
+// through psh_cmd_run_opt are tracked right away, procs appended
+// by hand are tracked on the next wait. Each tracked proc gets a
+// pidfd registered with the reaper, so an exiting child wakes the
+// reaper exactly once instead of being found by a waitpid scan.
+static inline void psh__procs_watch(Psh_Procs *procs) {
+#ifdef PSH__HAS_PIDFD
+    static b32 pidfd_unsupported = false;
+#endif
 
-    // Execute previous cmd
-    if (p->cmd.count != 0) {
-        Psh_Fd fds[2];
-        if (pipe(fds) < 0) {
-            p->error = true;
-            psh_logger(PSH_ERROR, "Could not create pipes %s", strerror(errno));
-            psh_fd_close_safe(p->prev_read_fd);
-            return false;
+    psh__procs_clamp(procs);
+    while (procs->watches.count < procs->count) {
+        Psh_Proc pid = procs->items[procs->watches.count];
+        Psh_Proc_Watch watch = {
+            .pid = pid,
+            .pidfd = PSH_INVALID_FD,
+            .started_ns = psh_time_now_ns(),
+        };
+
+#ifdef PSH__HAS_PIDFD
+        if (procs->watches.count == 0) {
+            procs->reaper = epoll_create1(EPOLL_CLOEXEC);
+            if (procs->reaper < 0)
+                psh_logger(PSH_WARNING, "Could not create reaper, polling procs: %s", strerror(errno));
         }
 
-        psh__pipeline_setup_opt(&p->cmd_opt, p->p_opt, p->prev_read_fd, fds[STDOUT_FILENO]);
-        // closes all non-default fds passed to it
-        b32 ok = psh_cmd_run_opt(&p->cmd, p->cmd_opt);
+        if (procs->reaper >= 0 && !pidfd_unsupported) {
+            watch.pidfd = syscall(SYS_pidfd_open, pid, 0);
+            if (watch.pidfd < 0) {
+                if (errno == ENOSYS) pidfd_unsupported = true;
+                else psh_logger(PSH_WARNING, "Could not open pidfd for pid %d, polling it: %s", pid, strerror(errno));
+            }
+        }
 
-        if (!ok) {
-            p->error = true;
-            psh_fd_close(fds[STDIN_FILENO]);
-            return false;
+        if (watch.pidfd >= 0) {
+            struct epoll_event event = {
+                .events = EPOLLIN,
+                .data.u64 = (u32)pid,
+            };
+            if (epoll_ctl(procs->reaper, EPOLL_CTL_ADD, watch.pidfd, &event) < 0) {
+                psh_logger(PSH_WARNING, "Could not watch pid %d, polling it: %s", pid, strerror(errno));
+                psh_fd_close(watch.pidfd);
+                watch.pidfd = PSH_INVALID_FD;
+            }
         }
+#endif
 
-        p->prev_read_fd = fds[STDIN_FILENO];
+        psh_list_append(&procs->watches, watch);
     }
+}
 
-    p->cmd_opt = new_cmd_opt;
-    p->cmd = (Psh_Cmd) {0};
-    psh_list_append_many(&p->cmd, new_cmd->items, new_cmd->count);
+static inline void psh__proc_unwatch(Psh_Procs *procs, Psh_Proc_Watch watch) {
+#ifdef PSH__HAS_PIDFD
+    if (watch.pidfd >= 0) {
+        // Forked children may still share the pidfd, so
+        // closing it alone would not remove it from the reaper
+        epoll_ctl(procs->reaper, EPOLL_CTL_DEL, watch.pidfd, NULL);
+        psh_fd_close(watch.pidfd);
+    }
+#else
+    (void)procs;
+    (void)watch;
+#endif
+}
 
-    new_cmd->count = 0;
+static inline void psh__procs_close_reaper(Psh_Procs *procs) {
+#ifdef PSH__HAS_PIDFD
+    if (procs->reaper >= 0) psh_fd_close(procs->reaper);
+#endif
+    psh_list_free(procs->watches);
+    procs->watches = (Psh_Proc_Watches) {0};
+}
 
-    return true;
+// Procs dropped from items by hand (count lowered without
+// psh_procs_reset, maybe with new procs appended since) lose
+// their watches here, from the first one that does not match
+static inline void psh__procs_clamp(Psh_Procs *procs) {
+    usize kept = 0;
+    while (kept < procs->watches.count && kept < procs->count &&
+           procs->watches.items[kept].pid == procs->items[kept]) ++kept;
+    if (kept == procs->watches.count) return;
+
+    for (usize i = kept; i < procs->watches.count; ++i)
+        psh__proc_unwatch(procs, procs->watches.items[i]);
+    procs->watches.count = kept;
+    if (kept == 0) psh__procs_close_reaper(procs);
 }
 
-b32 psh_pipeline_end(Psh_Pipeline *p) {
-    if (p->error) return false;
+static inline void psh__procs_remove(Psh_Procs *procs, usize i) {
+    psh__procs_clamp(procs);
+    PSH_ASSERT(i < procs->watches.count);
+    // Keep tracked procs contiguous at the front
+    usize last_watched = --procs->watches.count;
+    procs->items[i] = procs->items[last_watched];
+    procs->watches.items[i] = procs->watches.items[last_watched];
+    procs->items[last_watched] = procs->items[--procs->count];
 
-    psh__pipeline_setup_opt(&p->cmd_opt, p->p_opt, p->prev_read_fd, STDOUT_FILENO);
-    b32 ok = psh_cmd_run_opt(&p->cmd, p->cmd_opt);
+    if (procs->watches.count == 0) psh__procs_close_reaper(procs);
+}
 
-    psh_list_free(p->cmd);
-    *p = (Psh_Pipeline) {0};
-    return ok;
+void psh_procs_reset(Psh_Procs *procs) {
+    procs->count = 0;
+    psh__procs_clamp(procs);
 }
 
-static inline void psh__pipeline_setup_opt(
-    Psh_Cmd_Opt *prev_cmd_opt,
-    Psh_Pipeline_Opt p_opt,
-    Psh_Fd p_fdin,
-    Psh_Fd p_fdout
-) {
-    // If prev_cmd_opt has non-default settings it means 
-    // the user has opened a file for redirection. 
-    // Close the fds from pipes and leave user fds.
-    if (psh_fd_not_default(prev_cmd_opt->fdin)) {
-        psh_fd_close(p_fdin);
-    } else { // Otherwise continue with pipe fds
-        prev_cmd_opt->fdin = p_fdin;
-    }
+void psh_procs_free(Psh_Procs *procs) {
+    psh_procs_reset(procs);
+    psh_list_free(*procs);
+    *procs = (Psh_Procs) {0};
+}
 
-    if (psh_fd_not_default(prev_cmd_opt->fdout)) {
-        psh_fd_close(p_fdout);
-    } else {
-        prev_cmd_opt->fdout = p_fdout;
-    }
+// Returns 1 if items[i] was reaped, 0 if it is still running, -1 on error
+static inline i32 psh__procs_reap(Psh_Procs *procs, usize i, i32 options, Psh_Proc_Status *status) {
+    Psh_Proc pid = procs->items[i];
+    Psh_Proc_Watch watch = procs->watches.items[i];
 
-    // Pipeline options override only default cmd settings
-    // Priority (highest to lowest):
-    // cmd_opt > pipeline_opt > default settings
-    if (prev_cmd_opt->async == NULL)  prev_cmd_opt->async = p_opt.async;
-    if (prev_cmd_opt->max_procs == 0) prev_cmd_opt->max_procs = p_opt.max_procs;
-}
+    i32 wstatus;
+    struct rusage usage;
+    Psh_Proc ret;
+    while ((ret = wait4(pid, &wstatus, options, &usage)) < 0 && errno == EINTR);
 
-// pipeline IMPL END
+    if (ret == 0) return 0;
 
-// pipe IMPL START
+    *status = (Psh_Proc_Status) {.pid = pid};
+    psh__proc_unwatch(procs, watch);
+    psh__procs_remove(procs, i);
 
-b32 psh_pipe_open(Psh_Unix_Pipe *upipe) {
+    if (ret < 0) {
+        psh_logger(PSH_ERROR, "could not wait on command (pid %d): %s", pid, strerror(errno));
+        return -1;
+    }
+
+    status->wall_ns = psh_time_now_ns() - watch.started_ns;
+    status->rusage = usage;
+    if (WIFEXITED(wstatus)) {
+        status->exited = true;
+        status->exit_code = WEXITSTATUS(wstatus);
+    } else if (WIFSIGNALED(wstatus)) {
+        status->signal = WTERMSIG(wstatus);
+    }
+
+    return 1;
+}
+
+b32 psh_procs_wait_any(Psh_Procs *procs, Psh_Proc_Status *status) {
+    if (procs->count == 0) {
+        psh_logger(PSH_ERROR, "There are no procs to wait on");
+        return false;
+    }
+
+    psh__procs_watch(procs);
+
+    usize polled = 0;
+    for (usize i = 0; i < procs->watches.count; ++i)
+        if (procs->watches.items[i].pidfd < 0) ++polled;
+
+    for (;;) {
+#ifdef PSH__HAS_PIDFD
+        if (polled < procs->count) {
+            struct epoll_event event;
+            i32 n = epoll_wait(procs->reaper, &event, 1, polled > 0 ? 0 : -1);
+            if (n < 0 && errno != EINTR) {
+                psh_logger(PSH_ERROR, "Could not wait on reaper: %s", strerror(errno));
+                return false;
+            }
+
+            if (n > 0) {
+                Psh_Proc pid = (Psh_Proc)(u32)event.data.u64;
+                for (usize i = 0; i < procs->count; ++i) {
+                    // the child has exited, so this does not block
+                    if (procs->items[i] == pid)
+                        return psh__procs_reap(procs, i, 0, status) > 0;
+                }
+                PSH_UNREACHABLE("reaped pid is not in procs");
+            }
+        }
+#endif
+
+        if (polled == 0) continue;
+
+        for (usize i = 0; i < procs->count; ++i) {
+            if (procs->watches.items[i].pidfd >= 0) continue;
+
+            i32 ret = psh__procs_reap(procs, i, WNOHANG, status);
+            if (ret != 0) return ret > 0;
+        }
+
+        #define SLEEP_MS 1
+        #define SLEEP_NS SLEEP_MS * 1000 * 1000
+        static struct timespec duration = {
+            .tv_sec = SLEEP_NS / (1000*1000*1000),
+            .tv_nsec = SLEEP_NS % (1000*1000*1000),
+        };
+
+        nanosleep(&duration, NULL);
+    }
+}
+
+b32 psh_proc_status_ok(Psh_Proc_Status status) {
+    return status.exited && status.exit_code == EXIT_SUCCESS;
+}
+
+static inline b32 psh__proc_status_check(Psh_Proc_Status status) {
+    if (status.exited) {
+        if (status.exit_code != EXIT_SUCCESS)
+            psh_logger(PSH_ERROR, "command exited with exit code %d", status.exit_code);
+        return status.exit_code == EXIT_SUCCESS;
+    }
+
+    psh_logger(PSH_ERROR, "command process was terminated by signal %d", status.signal);
+    return false;
+}
+
+static inline void psh__cmd_build_cstr(Psh_Cmd cmd, Psh_Sb *sb) {
+    for (usize i = 0; i < cmd.count; ++i) {
+        byte *arg = cmd.items[i];
+        if (arg == NULL) return;
+        if (i > 0) psh_sb_append(sb, ' ');
+        psh_sb_append_cstr(sb, arg);
+    }
+    psh_sb_append_null(sb);
+}
+
+static inline void psh__cmd_opt_close_fds(Psh_Cmd_Opt opt) {
+    if (!opt.keep_fdin_open)  psh_fd_close_safe(opt.fdin);
+    if (!opt.keep_fdout_open) psh_fd_close_safe(opt.fdout);
+    if (!opt.keep_fderr_open) psh_fd_close_safe(opt.fderr);
+    if (!opt.keep_tap_open && opt.tap != PSH_INVALID_FD) psh_fd_close_safe(opt.tap);
+}
+
+static inline i32 psh__nprocs(void) {
+    return sysconf(_SC_NPROCESSORS_ONLN);
+}
+// cmd IMPL END
+
+// pipeline IMPL START
+
+static inline void psh__pipeline_setup_opt(Psh_Cmd_Opt *prev_cmd_opt, 
+    Psh_Pipeline_Opt p_opt, Psh_Fd p_fdin, Psh_Fd p_fdout);
+
+b32 psh_pipeline_chain_opt(Psh_Pipeline *p, Psh_Cmd *new_cmd, Psh_Cmd_Opt new_cmd_opt) {
+    if (p->error) return false;
+
+    // Execute previous cmd
+    if (p->cmd.count != 0) {
+        Psh_Unix_Pipe upipe;
+        if (!psh_pipe_open(&upipe, .pipe_size = p->p_opt.pipe_size)) {
+            p->error = true;
+            psh_fd_close_safe(p->prev_read_fd);
+            return false;
+        }
+
+        psh__pipeline_setup_opt(&p->cmd_opt, p->p_opt, p->prev_read_fd, upipe.write_fd);
+        // closes all non-default fds passed to it
+        b32 ok = psh_cmd_run_opt(&p->cmd, p->cmd_opt);
+
+        if (!ok) {
+            p->error = true;
+            psh_fd_close(upipe.read_fd);
+            return false;
+        }
+
+        p->prev_read_fd = upipe.read_fd;
+    }
+
+    p->cmd_opt = new_cmd_opt;
+    p->cmd = (Psh_Cmd) {0};
+    psh_list_append_many(&p->cmd, new_cmd->items, new_cmd->count);
+
+    new_cmd->count = 0;
+
+    return true;
+}
+
+b32 psh_pipeline_end(Psh_Pipeline *p) {
+    if (p->error) return false;
+
+    psh__pipeline_setup_opt(&p->cmd_opt, p->p_opt, p->prev_read_fd, STDOUT_FILENO);
+    b32 ok = psh_cmd_run_opt(&p->cmd, p->cmd_opt);
+
+    psh_list_free(p->cmd);
+    *p = (Psh_Pipeline) {0};
+    return ok;
+}
+
+static inline void psh__pipeline_setup_opt(
+    Psh_Cmd_Opt *prev_cmd_opt,
+    Psh_Pipeline_Opt p_opt,
+    Psh_Fd p_fdin,
+    Psh_Fd p_fdout
+) {
+    // If prev_cmd_opt has non-default settings it means 
+    // the user has opened a file for redirection. 
+    // Close the fds from pipes and leave user fds.
+    // p_fdin is STDIN_FILENO for the first stage and p_fdout
+    // is STDOUT_FILENO for the last one, these stay open
+    if (psh_fd_not_default(prev_cmd_opt->fdin)) {
+        psh_fd_close_safe(p_fdin);
+    } else { // Otherwise continue with pipe fds
+        prev_cmd_opt->fdin = p_fdin;
+    }
+
+    if (psh_fd_not_default(prev_cmd_opt->fdout)) {
+        psh_fd_close_safe(p_fdout);
+    } else {
+        prev_cmd_opt->fdout = p_fdout;
+    }
+
+    // Pipeline options override only default cmd settings
+    // Priority (highest to lowest):
+    // cmd_opt > pipeline_opt > default settings
+    if (prev_cmd_opt->async == NULL)  prev_cmd_opt->async = p_opt.async;
+    if (prev_cmd_opt->max_procs == 0) prev_cmd_opt->max_procs = p_opt.max_procs;
+}
+
+// pipeline IMPL END
+
+// graph IMPL START
+
+static inline u64 psh__proc_hash(Psh_Proc pid) { return (u64)(u32)pid; }
+static inline b32 psh__proc_equal(Psh_Proc a, Psh_Proc b) { return a == b; }
+
+static inline void psh__graph_finish(Psh_Graph *g, Psh_Job job, List(Psh_Job) *ready);
+static inline void psh__graph_critical_path(Psh_Graph *g);
+
+Psh_Job psh_graph_add_opt(Psh_Graph *g, Psh_Cmd *cmd, Psh_Cmd_Opt opt) {
+    Psh_Job_Node node = {
+        .opt = opt,
+        .critical_pred = PSH_INVALID_JOB,
+    };
+    psh_list_append_many(&node.cmd, cmd->items, cmd->count);
+    cmd->count = 0;
+
+    psh_list_append(&g->nodes, node);
+    return g->nodes.count - 1;
+}
+
+void psh_graph_depend(Psh_Graph *g, Psh_Job job, Psh_Job dependency) {
+    PSH_ASSERT(0 <= job && job < g->nodes.count && "Invalid job");
+    PSH_ASSERT(0 <= dependency && dependency < g->nodes.count && "Invalid dependency");
+    psh_list_append(&g->nodes.items[dependency].successors, job);
+}
+
+b32 psh_graph_run_opt(Psh_Graph *g, Psh_Graph_Opt opt) {
+    b32 result = true;
+    u8 max_procs = opt.max_procs > 0 ? opt.max_procs : psh__nprocs() + 1;
+
+    psh_hash_map_free(&g->running);
+    g->running = (Psh_HashMap(Psh_Proc, Psh_Job)) {
+        .key_hash = psh__proc_hash,
+        .key_equal = psh__proc_equal,
+    };
+
+    psh_list_foreach(Psh_Job_Node, node, &g->nodes) node->pending = 0;
+    psh_list_foreach(Psh_Job_Node, node, &g->nodes) {
+        psh_list_foreach(Psh_Job, succ, &node->successors)
+            g->nodes.items[*succ].pending++;
+    }
+
+    List(Psh_Job) ready = {0};
+    for (Psh_Job job = g->nodes.count - 1; job >= 0; --job) {
+        if (g->nodes.items[job].pending == 0) psh_list_append(&ready, job);
+    }
+
+    isize done = 0;
+    for (;;) {
+        // psh_procs_wait_any must see every exit, so never
+        // let psh_cmd_run_opt block on max_procs by itself
+        while (result && ready.count > 0) {
+            Psh_Job job = psh_list_last(&ready);
+            Psh_Job_Node *node = &g->nodes.items[job];
+
+            // a tap helper takes a slot of its own
+            isize slots = node->opt.tap != PSH_INVALID_FD ? 2 : 1;
+            if (g->procs.count > 0 && g->procs.count + slots > max_procs) break;
+            psh_list_pop(&ready);
+
+            Psh_Cmd_Opt cmd_opt = node->opt;
+            cmd_opt.async = &g->procs;
+            cmd_opt.max_procs = max_procs;
+            isize first = g->procs.count;
+            if (!psh_cmd_run_opt(&node->cmd, cmd_opt)) {
+                node->state = PSH_JOB_FAILED;
+                result = false;
+                break;
+            }
+
+            // The command comes first, then its tap helper if any
+            node->state = PSH_JOB_RUNNING;
+            node->pid = g->procs.items[first];
+            node->live = g->procs.count - first;
+            for (isize i = first; i < g->procs.count; ++i)
+                psh_hash_map_insert(&g->running, g->procs.items[i], job);
+        }
+
+        if (g->procs.count == 0) break;
+
+        Psh_Proc_Status status;
+        if (!psh_procs_wait_any(&g->procs, &status)) {
+            result = false;
+            psh_procs_block(&g->procs);
+            break;
+        }
+
+        Psh_Job *job = NULL;
+        psh_hash_map_get(&g->running, status.pid, &job);
+        PSH_ASSERT(job != NULL && "Graph proc without a job");
+        Psh_Job finished = *job;
+        psh_hash_map_remove(&g->running, status.pid);
+
+        Psh_Job_Node *node = &g->nodes.items[finished];
+        if (status.pid == node->pid) {
+            node->status = status;
+            node->path_ns += status.wall_ns;
+        }
+
+        if (!psh__proc_status_check(status)) {
+            node->state = PSH_JOB_FAILED;
+            result = false;
+        }
+
+        // A tapped job is done only once the helper has
+        // copied all of its stdout
+        if (--node->live > 0 || node->state == PSH_JOB_FAILED) continue;
+
+        ++done;
+        psh__graph_finish(g, finished, &ready);
+    }
+
+    if (result && done < g->nodes.count) {
+        psh_logger(PSH_ERROR, "Could not run %zd jobs: dependency cycle", g->nodes.count - done);
+        result = false;
+    }
+
+    // Jobs that never started still own their fds
+    psh_list_foreach(Psh_Job_Node, node, &g->nodes) {
+        if (node->state == PSH_JOB_PENDING) psh__cmd_opt_close_fds(node->opt);
+    }
+
+    psh__graph_critical_path(g);
+    psh_list_free(ready);
+    return result;
+}
+
+static inline void psh__graph_finish(Psh_Graph *g, Psh_Job job, List(Psh_Job) *ready) {
+    Psh_Job_Node *node = &g->nodes.items[job];
+    node->state = PSH_JOB_DONE;
+
+    psh_list_foreach(Psh_Job, succ, &node->successors) {
+        Psh_Job_Node *succ_node = &g->nodes.items[*succ];
+        if (succ_node->critical_pred == PSH_INVALID_JOB || node->path_ns > succ_node->path_ns) {
+            succ_node->path_ns = node->path_ns;
+            succ_node->critical_pred = job;
+        }
+        if (--succ_node->pending == 0) psh_list_append(ready, *succ);
+    }
+}
+
+static inline void psh__graph_critical_path(Psh_Graph *g) {
+    psh_list_clear(&g->critical_path);
+    g->critical_ns = 0;
+
+    Psh_Job last = PSH_INVALID_JOB;
+    for (Psh_Job job = 0; job < g->nodes.count; ++job) {
+        Psh_Job_Node *node = &g->nodes.items[job];
+        if (node->state != PSH_JOB_DONE) continue;
+        if (last == PSH_INVALID_JOB || node->path_ns > g->critical_ns) {
+            last = job;
+            g->critical_ns = node->path_ns;
+        }
+    }
+
+    for (Psh_Job job = last; job != PSH_INVALID_JOB; job = g->nodes.items[job].critical_pred)
+        psh_list_append(&g->critical_path, job);
+
+    for (isize i = 0, j = g->critical_path.count - 1; i < j; ++i, --j) {
+        Psh_Job tmp = g->critical_path.items[i];
+        g->critical_path.items[i] = g->critical_path.items[j];
+        g->critical_path.items[j] = tmp;
+    }
+}
+
+void psh_graph_free(Psh_Graph *g) {
+    psh_list_foreach(Psh_Job_Node, node, &g->nodes) {
+        psh_list_free(node->cmd);
+        psh_list_free(node->successors);
+    }
+    psh_list_free(g->nodes);
+    psh_procs_free(&g->procs);
+    psh_list_free(g->critical_path);
+    psh_hash_map_free(&g->running);
+    *g = (Psh_Graph) {0};
+}
+
+// graph IMPL END
+
+// pipe IMPL START
+
+#if defined(__linux__) && !defined(F_SETPIPE_SZ)
+    #define F_SETPIPE_SZ 1031
+#endif
+
+// Cached after the first call. Threads racing on it may each read
+// the file, but they only ever store the same complete value.
+static inline usize psh__pipe_max_size(void) {
+    static usize cached = 0;
+    usize max_size = __atomic_load_n(&cached, __ATOMIC_RELAXED);
+    if (max_size > 0) return max_size;
+
+    // Unprivileged processes cannot go above this limit
+    max_size = KB(1024);
+    FILE *file = fopen("/proc/sys/fs/pipe-max-size", "r");
+    if (file) {
+        unsigned long value;
+        if (fscanf(file, "%lu", &value) == 1 && value > 0) max_size = value;
+        fclose(file);
+    }
+    __atomic_store_n(&cached, max_size, __ATOMIC_RELAXED);
+    return max_size;
+}
+
+b32 psh_pipe_open_opt(Psh_Unix_Pipe *upipe, Psh_Pipe_Opt opt) {
     if (pipe((Psh_Fd *)upipe) < 0) {
         psh_logger(PSH_ERROR, "Could not create pipes: %s", strerror(errno));
         return false;
     }
 
+    if (opt.cloexec && (fcntl(upipe->read_fd, F_SETFD, FD_CLOEXEC) < 0 ||
+                        fcntl(upipe->write_fd, F_SETFD, FD_CLOEXEC) < 0))
+    {
+        psh_logger(PSH_ERROR, "Could not set close-on-exec on pipes: %s", strerror(errno));
+        psh_fd_close(upipe->read_fd);
+        psh_fd_close(upipe->write_fd);
+        return false;
+    }
+
+#ifdef F_SETPIPE_SZ
+    if (opt.pipe_size > 0) {
+        usize size = MIN(opt.pipe_size, psh__pipe_max_size());
+        // Not fatal, the pipe just keeps its current capacity
+        if (fcntl(upipe->write_fd, F_SETPIPE_SZ, (i32)size) < 0)
+            psh_logger(PSH_WARNING, "Could not resize pipe to %zu bytes: %s", size, strerror(errno));
+    }
+#else
+    PSH_UNUSED(opt);
+#endif
+
     return true;
 }
 
@@ -1117,103 +3060,868 @@ b32 psh__fd_set_nonblocking(Psh_Fd fd) {
         return false;
     }
 
-    if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
-        psh_logger(PSH_ERROR, "Could not set flags of fd(%d): %s", fd, strerror(errno));
+    if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        psh_logger(PSH_ERROR, "Could not set flags of fd(%d): %s", fd, strerror(errno));
+        return false;
+    }
+    
+    return true;
+}
+
+// Hands complete lines (or chunks) in store to on_data and drops
+// them. Bytes before new_data were already scanned for newlines.
+static inline
+void psh__fd_reader_stream(Psh_Fd_Reader *reader, usize new_data, b32 eof) {
+    Psh_Sb *store = &reader->store;
+    usize consumed = 0;
+
+    if (!reader->stream_chunks) {
+        for (usize i = new_data; i < store->count; ++i) {
+            if (store->items[i] != '\n') continue;
+
+            reader->on_data(reader, psh_s8(store->items + consumed, i - consumed));
+            consumed = i + 1;
+        }
+    }
+
+    usize tail = store->count - consumed;
+    if (tail > 0 && (reader->stream_chunks || eof || tail >= PSH_FD_READ_MAX_CHUNK)) {
+        reader->on_data(reader, psh_s8(store->items + consumed, tail));
+        consumed = store->count;
+    }
+
+    memmove(store->items, store->items + consumed, store->count - consumed);
+    store->count -= consumed;
+}
+
+// Streams data that sits in a buffer the reader does not own, like an
+// io_uring provided buffer. Lines and chunks are handed to on_data
+// straight from data, only a line that is not complete yet is copied
+// into store.
+static inline
+void psh__fd_reader_stream_buf(Psh_Fd_Reader *reader, byte *data, usize size) {
+    Psh_Sb *store = &reader->store;
+    if (reader->stream_chunks && store->count == 0) {
+        reader->on_data(reader, psh_s8(data, size));
+        return;
+    }
+
+    usize consumed = 0;
+    if (!reader->stream_chunks) {
+        for (usize i = 0; i < size; ++i) {
+            if (data[i] != '\n') continue;
+
+            if (store->count > 0) {
+                psh_sb_append_buf(store, data + consumed, i - consumed);
+                reader->on_data(reader, psh_s8(store->items, store->count));
+                store->count = 0;
+            } else {
+                reader->on_data(reader, psh_s8(data + consumed, i - consumed));
+            }
+            consumed = i + 1;
+        }
+    }
+
+    // the rest holds no newline
+    psh_sb_append_buf(store, data + consumed, size - consumed);
+    psh__fd_reader_stream(reader, store->count, false);
+}
+
+// Moves everything past the head of store into the tail ring
+static inline
+void psh__fd_reader_limit(Psh_Fd_Reader *reader) {
+    Psh_Sb *store = &reader->store;
+    if (store->count <= reader->keep_head) return;
+
+    byte *data = store->items + reader->keep_head;
+    usize size = store->count - reader->keep_head;
+    store->count = reader->keep_head;
+
+    usize cap = reader->keep_tail;
+    if (size > cap) {
+        reader->dropped += reader->tail_count + size - cap;
+        data += size - cap;
+        size = cap;
+        reader->tail_start = 0;
+        reader->tail_count = 0;
+    }
+    if (size == 0) return;
+
+    if (reader->tail_ring == NULL) {
+        reader->tail_ring = PSH_LIST_REALLOC(NULL, cap);
+        PSH_ASSERT(reader->tail_ring != NULL && "Buy more RAM lol");
+    }
+
+    // Overwrite the oldest bytes
+    usize overflow = reader->tail_count + size > cap ? reader->tail_count + size - cap : 0;
+    reader->dropped += overflow;
+    reader->tail_start = (reader->tail_start + overflow) % cap;
+    reader->tail_count -= overflow;
+
+    usize end = (reader->tail_start + reader->tail_count) % cap;
+    usize first = MIN(size, cap - end);
+    memcpy(reader->tail_ring + end, data, first);
+    memcpy(reader->tail_ring, data + first, size - first);
+    reader->tail_count += size;
+}
+
+static inline
+void psh__fd_reader_limit_end(Psh_Fd_Reader *reader) {
+    if (reader->tail_ring == NULL) return;
+
+    usize first = MIN(reader->tail_count, reader->keep_tail - reader->tail_start);
+    psh_sb_append_buf(&reader->store, reader->tail_ring + reader->tail_start, first);
+    psh_sb_append_buf(&reader->store, reader->tail_ring, reader->tail_count - first);
+
+    PSH_LIST_FREE(reader->tail_ring);
+    reader->tail_ring = NULL;
+    reader->tail_start = 0;
+    reader->tail_count = 0;
+}
+
+// Applies streaming or bounded capture to store[old_count..count)
+static inline
+void psh__fd_reader_received(Psh_Fd_Reader *reader, usize old_count) {
+    if (reader->on_data) psh__fd_reader_stream(reader, old_count, false);
+    else if (reader->limit_store) psh__fd_reader_limit(reader);
+}
+
+static inline
+void psh__fd_reader_eof(Psh_Fd_Reader *reader) {
+    if (reader->on_data) psh__fd_reader_stream(reader, reader->store.count, true);
+    else if (reader->limit_store) psh__fd_reader_limit_end(reader);
+    reader->ready = true;
+}
+
+// Reading failed, store keeps the head and tail seen so far
+static inline
+void psh__fd_reader_failed(Psh_Fd_Reader *reader) {
+    if (reader->limit_store) psh__fd_reader_limit_end(reader);
+}
+
+// With bounded capture a read never needs more room than the
+// limit, so the memory of a reader stays bounded by it
+static inline
+usize psh__fd_reader_max_chunk(Psh_Fd_Reader *reader) {
+    if (!reader->limit_store) return PSH_FD_READ_MAX_CHUNK;
+    return CLAMP(reader->keep_head + reader->keep_tail, PSH_FD_READ_MIN_CHUNK, PSH_FD_READ_MAX_CHUNK);
+}
+
+b32 psh_fd_read_opt(Psh_Fd_Reader *reader, Psh_Fd_Reader_Opt opt) {
+    if (reader->ready) return true;
+
+    if (opt.nonblocking && !reader->marked_nb) {
+        if (!psh__fd_set_nonblocking(reader->fd))
+            return false;
+
+        reader->marked_nb = true;
+    }
+
+    usize max_chunk = psh__fd_reader_max_chunk(reader);
+    if (reader->chunk == 0) reader->chunk = PSH_FD_READ_MIN_CHUNK;
+    if (opt.size_hint > 0) {
+        usize size_hint = reader->limit_store ? MIN(opt.size_hint, max_chunk) : opt.size_hint;
+        psh_list_reserve(&reader->store, reader->store.count + size_hint);
+        reader->chunk = CLAMP(size_hint, reader->chunk, max_chunk);
+    }
+
+    // Read straight into the spare capacity of store
+    isize n;
+    for (;;) {
+        psh_list_reserve(&reader->store, reader->store.count + reader->chunk);
+        usize spare = reader->store.capacity - reader->store.count;
+
+        n = read(reader->fd, reader->store.items + reader->store.count, spare);
+        if (n <= 0) break;
+
+        usize old_count = reader->store.count;
+        reader->store.count += n;
+        if ((usize)n == spare)
+            reader->chunk = MIN(reader->chunk * 2, max_chunk);
+
+        psh__fd_reader_received(reader, old_count);
+    }
+
+    if (n == 0) {
+        psh__fd_reader_eof(reader);
+        if (!opt.keep_fd_open) psh_fd_close_safe(reader->fd);
+        return true;
+    }
+
+    if (errno == EAGAIN || errno == EINTR)
+        return true;
+
+    psh_logger(PSH_ERROR, "Could not read fd(%d): %s", reader->fd, strerror(errno));
+    psh__fd_reader_failed(reader);
+    return false;
+}
+
+static inline
+b32 psh__fd_readers_poll(Psh_Fd_Reader readers[], usize rcount,
+                         Psh_Fd_Writer writers[], usize wcount, i64 timeout)
+{
+    struct pollfd pfds[rcount + wcount];
+    usize ridx[rcount + wcount];    // reader or writer index of pfds[i]
+    usize nfds = 0;
+    for (usize i = 0; i < rcount; ++i) {
+        if (readers[i].ready) continue;
+
+        ridx[nfds] = i;
+        pfds[nfds++] = (struct pollfd) {
+            .fd = readers[i].fd,   
+            .events = POLLIN,
+        };
+    }
+
+    usize nreaders = nfds;
+    for (usize i = 0; i < wcount; ++i) {
+        if (writers[i].ready) continue;
+
+        ridx[nfds] = i;
+        pfds[nfds++] = (struct pollfd) {
+            .fd = writers[i].fd,
+            .events = POLLOUT,
+        };
+    }
+
+    i32 n = poll(pfds, nfds, timeout);
+    if (n < 0) {
+        if (errno == EINTR) return true;
+
+        psh_logger(PSH_ERROR, "Could not poll: %s", strerror(errno));
+        return false;
+    }
+
+    if (n == 0) return true;
+
+    // POLLERR on a writer means the reader went away, writing tells us
+    for (usize i = nreaders; i < nfds; ++i) {
+        if (pfds[i].revents && !psh_fd_write(&writers[ridx[i]], .nonblocking = true))
+            return false;
+    }
+
+    for (usize i = 0; i < nreaders; ++i) {
+        Psh_Fd_Reader *reader = &readers[ridx[i]];
+        struct pollfd pfd = pfds[i];
+
+        if (pfd.revents & POLLERR) {
+            psh_logger(PSH_ERROR, "A poll error occured");
+            return false;
+        }
+
+        if (pfd.revents & (POLLIN | POLLHUP)) {
+            if (!psh_fd_read(reader, .nonblocking = true))
+                return false;
+        }
+    }
+
+    return true;
+}
+
+static inline
+b32 psh__fd_readers_ready(Psh_Fd_Reader r[], usize rcount) {
+    for (usize i = 0; i < rcount; ++i)
+        if (!r[i].ready) return false;
+
+    return true;
+}
+
+static inline
+b32 psh__fd_writers_ready(Psh_Fd_Writer w[], usize wcount) {
+    for (usize i = 0; i < wcount; ++i)
+        if (!w[i].ready) return false;
+
+    return true;
+}
+
+b32 psh_fd_readers_join(Psh_Fd_Reader r[], usize rcount)
+{ return psh_fd_join(r, rcount, NULL, 0); }
+
+b32 psh_fd_join(Psh_Fd_Reader r[], usize rcount, Psh_Fd_Writer w[], usize wcount) {
+    // Start every writer, most of the time the pipe takes it all
+    for (usize i = 0; i < wcount; ++i)
+        if (!psh_fd_write(&w[i], .nonblocking = true))
+            return false;
+
+    while (!psh__fd_readers_ready(r, rcount) || !psh__fd_writers_ready(w, wcount))
+        if (!psh__fd_readers_poll(r, rcount, w, wcount, -1))
+            return false;
+
+    return true;
+}
+
+void psh_fd_writer_push(Psh_Fd_Writer *writer, psh_s8 data) {
+    if (data.len == 0) return;
+    psh_list_append(&writer->queue, data);
+    writer->ready = false;
+}
+
+// limits.h only has it with _XOPEN_SOURCE, Linux allows 1024
+#ifndef IOV_MAX
+    #define IOV_MAX 1024
+#endif
+
+// Returns true once the whole queue is written. Partial writes only
+// move sent and offset forward, the next call picks up from there.
+static inline
+b32 psh__fd_writer_flush(Psh_Fd_Writer *writer, b32 *failed) {
+    struct iovec iov[IOV_MAX];
+    while (writer->sent < writer->queue.count) {
+        i32 iovcnt = 0;
+        for (isize i = writer->sent; i < writer->queue.count && iovcnt < IOV_MAX; ++i, ++iovcnt) {
+            usize skip = i == writer->sent ? writer->offset : 0;
+            iov[iovcnt] = (struct iovec) {
+                .iov_base = writer->queue.items[i].s + skip,
+                .iov_len = writer->queue.items[i].len - skip,
+            };
+        }
+
+        isize n = writev(writer->fd, iov, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) return false;
+            if (errno == EPIPE) {
+                writer->broken = true;
+                return true;
+            }
+
+            psh_logger(PSH_ERROR, "Could not write fd(%d): %s", writer->fd, strerror(errno));
+            *failed = true;
+            return false;
+        }
+
+        usize written = n;
+        while (written > 0) {
+            usize left = writer->queue.items[writer->sent].len - writer->offset;
+            if (written < left) {
+                writer->offset += written;
+                break;
+            }
+            written -= left;
+            writer->offset = 0;
+            writer->sent++;
+        }
+    }
+
+    return true;
+}
+
+b32 psh_fd_write_opt(Psh_Fd_Writer *writer, Psh_Fd_Writer_Opt opt) {
+    if (writer->ready) return true;
+
+    if (opt.nonblocking && !writer->marked_nb) {
+        if (!psh__fd_set_nonblocking(writer->fd))
+            return false;
+
+        writer->marked_nb = true;
+    }
+
+    // A closed reader would kill us with SIGPIPE, get EPIPE instead
+    // and drop the signal if it was raised
+    sigset_t sigpipe, old_mask;
+    sigemptyset(&sigpipe);
+    sigaddset(&sigpipe, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &sigpipe, &old_mask);
+
+    b32 failed = false;
+    b32 done = psh__fd_writer_flush(writer, &failed);
+
+    if (writer->broken) {
+        struct timespec no_wait = {0};
+        sigtimedwait(&sigpipe, NULL, &no_wait);
+    }
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+    if (failed) return false;
+    if (!done) return true;
+
+    writer->queue.count = 0;
+    writer->sent = 0;
+    writer->offset = 0;
+    writer->ready = true;
+    if (!opt.keep_fd_open) psh_fd_close_safe(writer->fd);
+    return true;
+}
+
+#ifdef PSH__HAS_IO_URING
+
+// Not in older uapi headers
+#define PSH__IORING_OP_READ_MULTISHOT 49
+#define PSH__URING_ENTRIES 256
+#define PSH__URING_BGID 0
+
+struct Psh__Uring {
+    Psh_Fd fd;
+    void *ring;
+    usize ring_size;
+    struct io_uring_sqe *sqes;
+    usize sqes_size;
+
+    u32 *sq_head, *sq_tail, *sq_array, sq_mask, sq_entries;
+    u32 *cq_head, *cq_tail, cq_mask;
+    struct io_uring_cqe *cqes;
+    u32 to_submit;
+
+    // provided buffers the kernel picks from for every read
+    struct io_uring_buf_ring *buf_ring;
+    usize buf_ring_size;
+    byte *buffers;
+    u32 buffer_count, buffer_size;
+};
+
+static inline i32 psh__uring_enter(Psh_Fd fd, u32 to_submit, u32 min_complete, u32 flags, void *arg, usize arg_size)
+{ return syscall(SYS_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size); }
+
+static inline i32 psh__uring_register(Psh_Fd fd, u32 opcode, void *arg, u32 nr_args)
+{ return syscall(SYS_io_uring_register, fd, opcode, arg, nr_args); }
+
+static inline void psh__uring_destroy(struct Psh__Uring *uring) {
+    if (uring->buffers)  munmap(uring->buffers, (usize)uring->buffer_count * uring->buffer_size);
+    if (uring->buf_ring) munmap(uring->buf_ring, uring->buf_ring_size);
+    if (uring->sqes)     munmap(uring->sqes, uring->sqes_size);
+    if (uring->ring)     munmap(uring->ring, uring->ring_size);
+    psh_fd_close(uring->fd);
+    PSH_LIST_FREE(uring);
+}
+
+static inline b32 psh__uring_supports_multishot_read(Psh_Fd fd) {
+    usize size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = PSH_LIST_REALLOC(NULL, size);
+    PSH_ASSERT(probe != NULL && "Buy more RAM lol");
+    memset(probe, 0, size);
+
+    b32 result = psh__uring_register(fd, IORING_REGISTER_PROBE, probe, 256) == 0
+        && probe->last_op >= PSH__IORING_OP_READ_MULTISHOT
+        && (probe->ops[PSH__IORING_OP_READ_MULTISHOT].flags & IO_URING_OP_SUPPORTED);
+
+    PSH_LIST_FREE(probe);
+    return result;
+}
+
+static inline void psh__uring_recycle(struct Psh__Uring *uring, u16 bid) {
+    u16 tail = __atomic_load_n(&uring->buf_ring->tail, __ATOMIC_RELAXED);
+    struct io_uring_buf *buf = &uring->buf_ring->bufs[tail & (uring->buffer_count - 1)];
+    buf->addr = (u64)(uptr)(uring->buffers + (usize)bid * uring->buffer_size);
+    buf->len = uring->buffer_size;
+    buf->bid = bid;
+    __atomic_store_n(&uring->buf_ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// Returns NULL if io_uring cannot be used on this system
+static inline struct Psh__Uring *psh__uring_create(Psh_Reactor_Opt opt) {
+    struct io_uring_params params = {0};
+    Psh_Fd fd = syscall(SYS_io_uring_setup, PSH__URING_ENTRIES, &params);
+    if (fd < 0) return NULL;
+
+    struct Psh__Uring *uring = PSH_LIST_REALLOC(NULL, sizeof(*uring));
+    PSH_ASSERT(uring != NULL && "Buy more RAM lol");
+    *uring = (struct Psh__Uring) {
+        .fd = fd,
+        .buffer_count = opt.buffer_count > 0 ? opt.buffer_count : 64,
+        .buffer_size = opt.buffer_size > 0 ? opt.buffer_size : PSH_FD_READ_MIN_CHUNK,
+    };
+    PSH_ASSERT((uring->buffer_count & (uring->buffer_count - 1)) == 0 && "buffer_count must be a power of two");
+
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !psh__uring_supports_multishot_read(fd)) {
+        psh__uring_destroy(uring);
+        return NULL;
+    }
+
+    usize sq_size = params.sq_off.array + params.sq_entries * sizeof(u32);
+    usize cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    uring->ring_size = MAX(sq_size, cq_size);
+    uring->ring = mmap(NULL, uring->ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (uring->ring == MAP_FAILED) {
+        uring->ring = NULL;
+        psh__uring_destroy(uring);
+        return NULL;
+    }
+
+    uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    uring->sqes = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (uring->sqes == MAP_FAILED) {
+        uring->sqes = NULL;
+        psh__uring_destroy(uring);
+        return NULL;
+    }
+
+    byte *ring = uring->ring;
+    uring->sq_head    = (u32 *)(ring + params.sq_off.head);
+    uring->sq_tail    = (u32 *)(ring + params.sq_off.tail);
+    uring->sq_array   = (u32 *)(ring + params.sq_off.array);
+    uring->sq_mask    = *(u32 *)(ring + params.sq_off.ring_mask);
+    uring->sq_entries = params.sq_entries;
+    uring->cq_head    = (u32 *)(ring + params.cq_off.head);
+    uring->cq_tail    = (u32 *)(ring + params.cq_off.tail);
+    uring->cq_mask    = *(u32 *)(ring + params.cq_off.ring_mask);
+    uring->cqes       = (struct io_uring_cqe *)(ring + params.cq_off.cqes);
+
+    usize page_size = sysconf(_SC_PAGESIZE);
+    uring->buf_ring_size = (uring->buffer_count * sizeof(struct io_uring_buf) + page_size - 1) / page_size * page_size;
+    uring->buf_ring = mmap(NULL, uring->buf_ring_size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    uring->buffers = mmap(NULL, (usize)uring->buffer_count * uring->buffer_size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (uring->buf_ring == MAP_FAILED) uring->buf_ring = NULL;
+    if (uring->buffers == MAP_FAILED) uring->buffers = NULL;
+
+    struct io_uring_buf_reg reg = {
+        .ring_addr = (u64)(uptr)uring->buf_ring,
+        .ring_entries = uring->buffer_count,
+        .bgid = PSH__URING_BGID,
+    };
+    if (!uring->buf_ring || !uring->buffers ||
+        psh__uring_register(fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+        psh__uring_destroy(uring);
+        return NULL;
+    }
+
+    for (u32 bid = 0; bid < uring->buffer_count; ++bid)
+        psh__uring_recycle(uring, bid);
+
+    return uring;
+}
+
+static inline b32 psh__uring_submit(struct Psh__Uring *uring, u32 min_complete, i64 timeout) {
+    u32 flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+    struct __kernel_timespec ts = {
+        .tv_sec = timeout / 1000,
+        .tv_nsec = (timeout % 1000) * 1000000,
+    };
+    struct io_uring_getevents_arg arg = {.ts = (u64)(uptr)&ts};
+    b32 with_timeout = min_complete > 0 && timeout >= 0;
+    if (with_timeout) flags |= IORING_ENTER_EXT_ARG;
+
+    i32 n = psh__uring_enter(uring->fd, uring->to_submit, min_complete, flags,
+                             with_timeout ? &arg : NULL, with_timeout ? sizeof(arg) : 0);
+    if (n < 0) {
+        if (errno == EINTR || errno == ETIME) return true;
+        psh_logger(PSH_ERROR, "Could not enter io_uring: %s", strerror(errno));
+        return false;
+    }
+
+    uring->to_submit -= MIN((u32)n, uring->to_submit);
+    return true;
+}
+
+static inline b32 psh__uring_read(struct Psh__Uring *uring, Psh_Fd_Reader *reader) {
+    u32 tail = *uring->sq_tail;
+    if (tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) >= uring->sq_entries) {
+        if (!psh__uring_submit(uring, 0, 0)) return false;
+    }
+
+    u32 index = tail & uring->sq_mask;
+    struct io_uring_sqe *sqe = &uring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = PSH__IORING_OP_READ_MULTISHOT;
+    sqe->fd = reader->fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = PSH__URING_BGID;
+    sqe->user_data = (u64)(uptr)reader;
+
+    uring->sq_array[index] = index;
+    __atomic_store_n(uring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    uring->to_submit++;
+    return true;
+}
+
+static inline void psh__reactor_deregister(Psh_Reactor *reactor, Psh_Fd_Reader *reader);
+
+static inline b32 psh__uring_poll(Psh_Reactor *reactor, i64 timeout) {
+    struct Psh__Uring *uring = reactor->uring;
+    if (!psh__uring_submit(uring, timeout == 0 ? 0 : 1, timeout)) return false;
+
+    u32 head = *uring->cq_head;
+    u32 tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+    b32 result = true;
+
+    for (; head != tail; ++head) {
+        struct io_uring_cqe *cqe = &uring->cqes[head & uring->cq_mask];
+        Psh_Fd_Reader *reader = (Psh_Fd_Reader *)(uptr)cqe->user_data;
+
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+            u16 bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            byte *data = uring->buffers + (usize)bid * uring->buffer_size;
+            if (cqe->res > 0 && reader->on_data) {
+                psh__fd_reader_stream_buf(reader, data, cqe->res);
+            } else if (cqe->res > 0) {
+                usize old_count = reader->store.count;
+                psh_sb_append_buf(&reader->store, data, cqe->res);
+                psh__fd_reader_received(reader, old_count);
+            }
+            psh__uring_recycle(uring, bid);
+        }
+
+        // The kernel keeps reading until it clears F_MORE
+        if (cqe->flags & IORING_CQE_F_MORE) continue;
+
+        if (cqe->res == 0) {
+            psh__fd_reader_eof(reader);
+            psh__reactor_deregister(reactor, reader);
+        } else if (cqe->res > 0 || cqe->res == -ENOBUFS || cqe->res == -EINTR || cqe->res == -EAGAIN) {
+            if (!psh__uring_read(uring, reader)) result = false;
+        } else {
+            psh_logger(PSH_ERROR, "Could not read fd(%d): %s", reader->fd, strerror(-cqe->res));
+            psh__fd_reader_failed(reader);
+            result = false;
+        }
+    }
+
+    __atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+    return result;
+}
+
+#endif
+
+#ifdef PSH__HAS_EPOLL
+
+b32 psh_reactor_init_opt(Psh_Reactor *reactor, Psh_Reactor_Opt opt) {
+    *reactor = (Psh_Reactor) {0};
+
+#ifdef PSH__HAS_IO_URING
+    if (opt.io_uring) {
+        reactor->uring = psh__uring_create(opt);
+        if (reactor->uring) return true;
+    }
+#else
+    PSH_UNUSED(opt);
+#endif
+
+    reactor->epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (reactor->epoll < 0) {
+        psh_logger(PSH_ERROR, "Could not create reactor: %s", strerror(errno));
         return false;
     }
-    
+
     return true;
 }
 
-b32 psh_fd_read_opt(Psh_Fd_Reader *reader, Psh_Fd_Reader_Opt opt) {
+b32 psh_reactor_add(Psh_Reactor *reactor, Psh_Fd_Reader *reader) {
     if (reader->ready) return true;
 
-    if (opt.nonblocking && !reader->marked_nb) {
+#ifdef PSH__HAS_IO_URING
+    if (reactor->uring) {
+        if (!psh__uring_read(reactor->uring, reader)) return false;
+        reactor->pending++;
+        return true;
+    }
+#endif
+
+    // Edge triggered, so every wakeup must drain the fd
+    if (!reader->marked_nb) {
         if (!psh__fd_set_nonblocking(reader->fd))
             return false;
 
         reader->marked_nb = true;
     }
 
-    isize n;
-    byte buffer[1024];
-    while ((n = read(reader->fd, buffer, sizeof buffer)) > 0)
-        psh_sb_append_buf(&reader->store, buffer, n);
-
-    if (n == 0) {
-        if (!opt.keep_fd_open) psh_fd_close_safe(reader->fd);
-        reader->ready = true;
-        return true;
+    struct epoll_event event = {
+        .events = EPOLLIN | EPOLLET,
+        .data.ptr = reader,
+    };
+    if (epoll_ctl(reactor->epoll, EPOLL_CTL_ADD, reader->fd, &event) < 0) {
+        psh_logger(PSH_ERROR, "Could not add fd(%d) to reactor: %s", reader->fd, strerror(errno));
+        return false;
     }
 
-    if (errno == EAGAIN || errno == EINTR)
-        return true;
-
-    psh_logger(PSH_ERROR, "Could not read fd(%d): %s", reader->fd, strerror(errno));
-    return false;
+    reactor->pending++;
+    return true;
 }
 
-static inline
-b32 psh__fd_readers_poll(Psh_Fd_Reader readers[], usize rcount, i64 timeout) {
-    struct pollfd pfds[rcount];
-    usize nfds = 0;
-    for (usize i = 0; i < rcount; ++i) {
-        if (readers[i].ready) continue;
+// Called once the reader is ready
+static inline void psh__reactor_deregister(Psh_Reactor *reactor, Psh_Fd_Reader *reader) {
+    // Forked children may share the fd, so
+    // closing it would not unregister it
+    if (!reactor->uring) epoll_ctl(reactor->epoll, EPOLL_CTL_DEL, reader->fd, NULL);
+    psh_fd_close_safe(reader->fd);
+    reactor->pending--;
+}
 
-        pfds[nfds++] = (struct pollfd) {
-            .fd = readers[i].fd,   
-            .events = POLLIN,
-        };
-    }
+b32 psh_reactor_poll(Psh_Reactor *reactor, i64 timeout) {
+#ifdef PSH__HAS_IO_URING
+    if (reactor->uring) return psh__uring_poll(reactor, timeout);
+#endif
 
-    i32 n = poll(pfds, nfds, timeout);
+    struct epoll_event events[64];
+    i32 n = epoll_wait(reactor->epoll, events, psh_countof(events), timeout);
     if (n < 0) {
         if (errno == EINTR) return true;
 
-        psh_logger(PSH_ERROR, "Could not poll: %s", strerror(errno));
+        psh_logger(PSH_ERROR, "Could not wait on reactor: %s", strerror(errno));
         return false;
     }
 
-    if (n == 0) return true;
-
-    for (usize i = 0; i < rcount; ++i) {
-        Psh_Fd_Reader *reader = &readers[i];
-        struct pollfd pfd = pfds[i];
-
+    for (i32 i = 0; i < n; ++i) {
+        Psh_Fd_Reader *reader = events[i].data.ptr;
         if (reader->ready) continue;
 
-        if (pfd.revents & POLLERR) {
-            psh_logger(PSH_ERROR, "A poll error occured");
+        if (events[i].events & EPOLLERR) {
+            psh_logger(PSH_ERROR, "A reactor error occured on fd(%d)", reader->fd);
             return false;
         }
 
-        if (pfd.revents & (POLLIN | POLLHUP)) {
-            if (!psh_fd_read(reader, .nonblocking = true))
-                return false;
-        }
+        if (!psh_fd_read(reader, .nonblocking = true, .keep_fd_open = true))
+            return false;
+
+        // psh_fd_read has already handled EOF
+        if (reader->ready) psh__reactor_deregister(reactor, reader);
     }
 
     return true;
 }
 
-static inline
-b32 psh__fd_readers_ready(Psh_Fd_Reader r[], usize rcount) {
-    for (usize i = 0; i < rcount; ++i)
-        if (!r[i].ready) return false;
+b32 psh_reactor_join(Psh_Reactor *reactor) {
+    while (reactor->pending > 0)
+        if (!psh_reactor_poll(reactor, -1))
+            return false;
 
     return true;
 }
 
-b32 psh_fd_readers_join(Psh_Fd_Reader r[], usize rcount) {
-    while (!psh__fd_readers_ready(r, rcount))
-        if (!psh__fd_readers_poll(r, rcount, -1))
-            return false;
+void psh_reactor_close(Psh_Reactor *reactor) {
+#ifdef PSH__HAS_IO_URING
+    if (reactor->uring) psh__uring_destroy(reactor->uring);
+    else
+#endif
+    psh_fd_close(reactor->epoll);
+    *reactor = (Psh_Reactor) {0};
+}
 
-    return true;
+#else
+
+b32 psh_reactor_init_opt(Psh_Reactor *reactor, Psh_Reactor_Opt opt) {
+    PSH_UNUSED(reactor);
+    PSH_UNUSED(opt);
+    psh_logger(PSH_ERROR, "Psh_Reactor is not supported on this platform");
+    return false;
 }
 
+b32 psh_reactor_add(Psh_Reactor *reactor, Psh_Fd_Reader *reader)
+{ PSH_UNUSED(reactor); PSH_UNUSED(reader); return false; }
+
+b32 psh_reactor_poll(Psh_Reactor *reactor, i64 timeout)
+{ PSH_UNUSED(reactor); PSH_UNUSED(timeout); return false; }
+
+b32 psh_reactor_join(Psh_Reactor *reactor)
+{ PSH_UNUSED(reactor); return false; }
+
+void psh_reactor_close(Psh_Reactor *reactor)
+{ PSH_UNUSED(reactor); }
+
+#endif
+
 // reader IMPL END
 
+// hash map file IMPL START
+
+static inline usize psh__hash_map_table_size(isize capacity, usize entry_size)
+{ return (usize)capacity * (entry_size + 1) + (usize)capacity / PSH_HASH_MAP_GROUP; }
+
+// Written to a temporary file and renamed, so readers
+// never map a half written file
+b32 psh__hash_map_save(byte *path, void const *items, Psh__HashMapFileHeader header) {
+    b32 result = true;
+    Psh_Sb tmp_path = {0};
+    psh_sb_append_cstr(&tmp_path, path);
+    psh_sb_append_cstr(&tmp_path, ".tmp");
+    psh_sb_append_null(&tmp_path);
+
+    memcpy(header.magic, PSH__HASH_MAP_FILE_MAGIC, sizeof(header.magic));
+    header.version = PSH__HASH_MAP_FILE_VERSION;
+    header.group = PSH_HASH_MAP_GROUP;
+    byte bytes[PSH__HASH_MAP_FILE_HEADER] = {0};
+    memcpy(bytes, &header, sizeof(header));
+
+    Psh_Fd fd = psh_fd_openw(tmp_path.items);
+    if (fd < 0) psh_return_defer(false);
+
+    if (!psh__fd_write_all(fd, bytes, sizeof(bytes)) ||
+        !psh__fd_write_all(fd, (byte *)items, psh__hash_map_table_size(header.capacity, header.entry_size)))
+    {
+        psh_logger(PSH_ERROR, "Could not write hash map to %s: %s", tmp_path.items, strerror(errno));
+        psh_fd_close(fd);
+        unlink(tmp_path.items);
+        psh_return_defer(false);
+    }
+
+    psh_fd_close(fd);
+    if (rename(tmp_path.items, path) < 0) {
+        psh_logger(PSH_ERROR, "Could not rename %s to %s: %s", tmp_path.items, path, strerror(errno));
+        unlink(tmp_path.items);
+        psh_return_defer(false);
+    }
+
+defer:
+    psh_list_free(tmp_path);
+    return result;
+}
+
+void *psh__hash_map_open(byte *path, usize entry_size, byte **mapping, usize *mapping_size) {
+    Psh_Fd fd = psh_fd_openr(path);
+    if (fd < 0) return NULL;
+
+    struct stat statbuf;
+    Psh__HashMapFileHeader header = {0};
+    b32 valid = fstat(fd, &statbuf) == 0
+        && (usize)statbuf.st_size >= PSH__HASH_MAP_FILE_HEADER
+        && pread(fd, &header, sizeof(header), 0) == sizeof(header)
+        && memcmp(header.magic, PSH__HASH_MAP_FILE_MAGIC, sizeof(header.magic)) == 0;
+    if (!valid) {
+        psh_logger(PSH_ERROR, "%s is not a hash map file", path);
+        psh_fd_close(fd);
+        return NULL;
+    }
+
+    if (header.version != PSH__HASH_MAP_FILE_VERSION || header.group != PSH_HASH_MAP_GROUP) {
+        psh_logger(PSH_ERROR, "%s has format version %u with groups of %u, expected version %d with groups of %d",
+                   path, header.version, header.group, PSH__HASH_MAP_FILE_VERSION, PSH_HASH_MAP_GROUP);
+        psh_fd_close(fd);
+        return NULL;
+    }
+
+    valid = header.entry_size == entry_size
+        && (header.capacity == 0 || (header.capacity >= PSH_HASH_MAP_GROUP &&
+                                     (header.capacity & (header.capacity - 1)) == 0))
+        && header.count + header.deleted_count <= header.capacity
+        && (usize)statbuf.st_size == PSH__HASH_MAP_FILE_HEADER + psh__hash_map_table_size(header.capacity, entry_size);
+    if (!valid) {
+        psh_logger(PSH_ERROR, "%s is not a hash map file for this entry type", path);
+        psh_fd_close(fd);
+        return NULL;
+    }
+
+    // MAP_PRIVATE makes every written page a private copy
+    byte *view = mmap(NULL, statbuf.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    psh_fd_close(fd);
+    if (view == MAP_FAILED) {
+        psh_logger(PSH_ERROR, "Could not map %s: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    *mapping = view;
+    *mapping_size = statbuf.st_size;
+    return view + PSH__HASH_MAP_FILE_HEADER;
+}
+
+// fingerprint is recomputed with the key_hash of the opening map
+b32 psh__hash_map_check_fingerprint(byte *path, u64 fingerprint, byte **mapping, usize mapping_size) {
+    Psh__HashMapFileHeader *header = (Psh__HashMapFileHeader *)*mapping;
+    if (header->fingerprint == fingerprint) return true;
+
+    psh_logger(PSH_ERROR, "%s was saved with a different key_hash", path);
+    psh__hash_map_unmap(*mapping, mapping_size);
+    *mapping = NULL;
+    return false;
+}
+
+void psh__hash_map_unmap(byte *mapping, usize mapping_size)
+{ munmap(mapping, mapping_size); }
+
+// hash map file IMPL END
+
 // arena IMPL START
 
 // Sources of Info:
@@ -1225,21 +3933,100 @@ b32 psh_fd_readers_join(Psh_Fd_Reader r[], usize rcount) {
 usize get_page_size(void) 
 { return sysconf(_SC_PAGESIZE); }
 
-Arena arena_init(usize reserve_size) {
+#ifndef MADV_POPULATE_WRITE
+    #define MADV_POPULATE_WRITE 23
+#endif
+
+#ifndef MAP_HUGE_SHIFT
+    #define MAP_HUGE_SHIFT 26
+#endif
+
+Arena arena_init_opt(ArenaOpt opt) {
     usize PAGE_SIZE = get_page_size();
+    usize reserve_size = opt.reserve_size ? opt.reserve_size : ARENA_RESERVE_SIZE;
+    void *block = MAP_FAILED;
+
+    if (opt.pages == ARENA_PAGES_HUGETLB) {
+        reserve_size = ALIGN_UP_POW2(reserve_size, ARENA_HUGE_PAGE_SIZE);
+        // Without MAP_NORESERVE the kernel takes the huge pages from the
+        // pool right here instead of failing with SIGBUS on first touch.
+        // Plain MAP_HUGETLB uses the default pool, which may hold 1 GB
+        // pages, so ask for the page size commits are stepped by.
+        i32 huge_size = __builtin_ctzll(ARENA_HUGE_PAGE_SIZE) << MAP_HUGE_SHIFT;
+        block = mmap(NULL, reserve_size, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | huge_size, -1, 0);
+        if (block != MAP_FAILED) PAGE_SIZE = ARENA_HUGE_PAGE_SIZE;
+        else opt.pages = ARENA_PAGES_THP;
+    }
+
+    if (opt.pages == ARENA_PAGES_THP) {
+        // Reserve one huge page more and cut the ends off, so the
+        // block starts on a huge page boundary
+        reserve_size = ALIGN_UP_POW2(reserve_size, ARENA_HUGE_PAGE_SIZE);
+        byte *over = mmap(NULL, reserve_size + ARENA_HUGE_PAGE_SIZE, PROT_NONE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        PSH_ASSERT(over != MAP_FAILED && "Buy more RAM lol");
+
+        byte *aligned = (byte *)ALIGN_UP_POW2(over, ARENA_HUGE_PAGE_SIZE);
+        if (aligned > over) munmap(over, aligned - over);
+        munmap(aligned + reserve_size, over + ARENA_HUGE_PAGE_SIZE - aligned);
+        madvise(aligned, reserve_size, MADV_HUGEPAGE);
+        block = aligned;
+
+        // Smaller commits would only get small pages
+        if (opt.commit_size < ARENA_HUGE_PAGE_SIZE) opt.commit_size = ARENA_HUGE_PAGE_SIZE;
+    }
 
-    // Align reservation up to the nearest page size
-    reserve_size = ALIGN_UP_POW2(reserve_size, PAGE_SIZE);
-    void* block = mmap(NULL, reserve_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    PSH_ASSERT(block != MAP_FAILED && "Buy more RAM lol");
+    if (block == MAP_FAILED) {
+        // Align reservation up to the nearest page size
+        reserve_size = ALIGN_UP_POW2(reserve_size, PAGE_SIZE);
+        block = mmap(NULL, reserve_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        PSH_ASSERT(block != MAP_FAILED && "Buy more RAM lol");
+    }
 
     return (Arena) {
         .base_ptr = block,
         .reserved_size = reserve_size,
-        .page_size = PAGE_SIZE
+        .page_size = PAGE_SIZE,
+        .commit_size = opt.commit_size,
+        .retain_size = opt.retain_size,
+        .commit_geometric = opt.commit_geometric,
+        .prefault = opt.prefault,
     };
 }
 
+static b32 psh__arena_commit(Arena *arena, usize new_offset) {
+    usize step = arena->commit_size;
+    if (arena->commit_geometric && arena->committed_size > step) {
+        step = arena->committed_size;
+    }
+
+    // Align the required commit size up to the nearest page
+    usize new_commit_target = MAX(new_offset, arena->committed_size + step);
+    new_commit_target = ALIGN_UP_POW2(new_commit_target, arena->page_size);
+
+    if (new_commit_target > arena->reserved_size) {
+        new_commit_target = arena->reserved_size;
+    }
+
+    usize commit_size = new_commit_target - arena->committed_size;
+    byte *commit_start_addr = arena->base_ptr + arena->committed_size;
+
+    if (mprotect(commit_start_addr, commit_size, PROT_READ | PROT_WRITE) != 0) {
+        return false;
+    }
+
+    // Kernels before 5.14 lack MADV_POPULATE_WRITE, touch every page instead
+    if (arena->prefault && madvise(commit_start_addr, commit_size, MADV_POPULATE_WRITE) != 0) {
+        for (usize i = 0; i < commit_size; i += arena->page_size) {
+            ((volatile byte *)commit_start_addr)[i] = 0;
+        }
+    }
+
+    arena->committed_size = new_commit_target;
+    return true;
+}
+
 void *arena_push_(Arena *arena, usize size, usize align, usize n) {
     if (arena->base_ptr == NULL) {
         *arena = arena_init(ARENA_RESERVE_SIZE);
@@ -1255,27 +4042,33 @@ void *arena_push_(Arena *arena, usize size, usize align, usize n) {
         return NULL;
     }
 
-    if (new_offset > arena->committed_size) {
-        // Align the required commit size up to the nearest page
-        usize new_commit_target = ALIGN_UP_POW2(new_offset, arena->page_size);
+    if (new_offset > arena->committed_size && !psh__arena_commit(arena, new_offset)) {
+        return NULL;
+    }
 
-        if (new_commit_target > arena->reserved_size) {
-            new_commit_target = arena->reserved_size;
-        }
+    void* memory = arena->base_ptr + offset;
+    arena->current_offset = new_offset;
 
-        usize commit_size = new_commit_target - arena->committed_size;
-        void *commit_start_addr = arena->base_ptr + arena->committed_size;
+    return memory;
+}
 
-        if (mprotect(commit_start_addr, commit_size, PROT_READ | PROT_WRITE) != 0) {
+void *arena_extend(Arena *arena, void *ptr, usize old_size, usize new_size, usize align) {
+    if (ptr && (byte *)ptr + old_size == arena->base_ptr + arena->current_offset) {
+        usize new_offset = (byte *)ptr - arena->base_ptr + new_size;
+        if (new_size > arena->reserved_size || new_offset > arena->reserved_size) {
             return NULL;
         }
 
-        arena->committed_size = new_commit_target;
-    }
+        if (new_offset > arena->committed_size && !psh__arena_commit(arena, new_offset)) {
+            return NULL;
+        }
 
-    void* memory = arena->base_ptr + offset;
-    arena->current_offset = new_offset;
+        arena->current_offset = new_offset;
+        return ptr;
+    }
 
+    void *memory = arena_push_(arena, new_size, align, 1);
+    if (memory && ptr) memcpy(memory, ptr, MIN(old_size, new_size));
     return memory;
 }
 
@@ -1291,8 +4084,16 @@ ArenaSP arena_savepoint(Arena *arena)
 void arena_restore(Arena *arena, ArenaSP savepoint)
 { arena->current_offset = savepoint; }
 
-void arena_clear(Arena *arena)
-{ arena_restore(arena, 0); }
+// Pages above retain_size stay committed but go back to the
+// kernel, touching them again gives fresh zero pages
+void arena_clear(Arena *arena) {
+    arena_restore(arena, 0);
+
+    usize retain = ALIGN_UP_POW2(arena->retain_size, arena->page_size);
+    if (arena->retain_size && arena->committed_size > retain) {
+        madvise(arena->base_ptr + retain, arena->committed_size - retain, MADV_DONTNEED);
+    }
+}
 
 Scratch scratch_begin(Arena *arena)
 { return (Scratch) { .arena = arena, .sp = arena_savepoint(arena)}; }
@@ -1322,8 +4123,380 @@ Scratch scratch_get_(Arena *conflicting_permanent_arenas[], usize conflict_num)
 
     PSH_UNREACHABLE("scratch arena not found");
 }
+
+AtomicArena atomic_arena_init(usize reserve_size) {
+    Arena arena = arena_init(reserve_size);
+    return (AtomicArena) {
+        .base_ptr = arena.base_ptr,
+        .reserved_size = arena.reserved_size,
+        .page_size = arena.page_size
+    };
+}
+
+void atomic_arena_destroy(AtomicArena arena)
+{ munmap(arena.base_ptr, arena.reserved_size); }
+
+void *atomic_arena_push_(AtomicArena *arena, usize size, usize align, usize n) {
+    usize current = __atomic_load_n(&arena->current_offset, __ATOMIC_RELAXED);
+    usize offset, new_offset;
+    do {
+        offset = ALIGN_UP_POW2(current, align);
+        if (n != 0 && size > (arena->reserved_size - offset) / n) {
+            return NULL;
+        }
+
+        new_offset = offset + size * n;
+        if (new_offset > arena->reserved_size) {
+            return NULL;
+        }
+    } while (!__atomic_compare_exchange_n(&arena->current_offset, &current, new_offset,
+                                          true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    if (new_offset > __atomic_load_n(&arena->committed_size, __ATOMIC_ACQUIRE)) {
+        psh__spin_lock(&arena->commit_lock);
+
+        // Another thread may have committed past new_offset while we waited
+        usize committed = arena->committed_size;
+        if (new_offset > committed) {
+            usize new_commit_target = ALIGN_UP_POW2(new_offset, ATOMIC_ARENA_COMMIT_SIZE);
+            new_commit_target = ALIGN_UP_POW2(new_commit_target, arena->page_size);
+
+            if (new_commit_target > arena->reserved_size) {
+                new_commit_target = arena->reserved_size;
+            }
+
+            if (mprotect(arena->base_ptr + committed, new_commit_target - committed,
+                         PROT_READ | PROT_WRITE) != 0)
+            {
+                psh__spin_unlock(&arena->commit_lock);
+                return NULL;
+            }
+
+            __atomic_store_n(&arena->committed_size, new_commit_target, __ATOMIC_RELEASE);
+        }
+
+        psh__spin_unlock(&arena->commit_lock);
+    }
+
+    return arena->base_ptr + offset;
+}
+
+void atomic_arena_clear(AtomicArena *arena)
+{ __atomic_store_n(&arena->current_offset, 0, __ATOMIC_RELAXED); }
+
+ArenaPool arena_pool_init_opt(ArenaOpt arena_opt)
+{ return (ArenaPool) { .arena_opt = arena_opt }; }
+
+Arena *arena_pool_get(ArenaPool *pool) {
+    psh__spin_lock(&pool->lock);
+    ArenaPoolEntry *entry = pool->free;
+    if (entry) {
+        pool->free = entry->next;
+    } else {
+        entry = arena_push(&pool->entries, ArenaPoolEntry);
+    }
+    psh__spin_unlock(&pool->lock);
+
+    // New arenas are mapped outside the lock
+    if (entry && entry->arena.base_ptr == NULL) {
+        entry->arena = arena_init_opt(pool->arena_opt);
+    }
+    return entry ? &entry->arena : NULL;
+}
+
+void arena_pool_put(ArenaPool *pool, Arena *arena) {
+    ArenaPoolEntry *entry = psh_container_of(arena, ArenaPoolEntry, arena);
+    arena_clear(arena);
+
+    psh__spin_lock(&pool->lock);
+    entry->next = pool->free;
+    pool->free = entry;
+    psh__spin_unlock(&pool->lock);
+}
+
+void arena_pool_destroy(ArenaPool *pool) {
+    for (ArenaPoolEntry *entry = pool->free; entry; entry = entry->next) {
+        arena_destroy(entry->arena);
+    }
+    if (pool->entries.base_ptr) arena_destroy(pool->entries);
+    *pool = (ArenaPool) { .arena_opt = pool->arena_opt };
+}
 // arena IMPL END
 
+// pool IMPL START
+
+#ifdef PSH_USE_POOL
+    Pool psh_pool = { .thread_cache = true };
+#endif
+
+typedef struct {
+    Pool *pool;
+    u64 id;                 // of the pool the blocks belong to
+    PoolBlock *free[POOL_CLASSES];
+    u32 count[POOL_CLASSES];
+} Psh__PoolCache;
+
+PSH_THREAD_CTX_MOD static Psh__PoolCache psh__pool_caches[POOL_THREAD_CACHES];
+static u64 psh__pool_next_id = 1;
+
+static inline isize psh__pool_class(usize size)
+{ return size <= (1 << POOL_MIN_CLASS) ? POOL_MIN_CLASS : 64 - __builtin_clzll(size - 1); }
+
+// Larger sizes take a run of whole slabs
+static inline b32 psh__pool_is_small(usize size)
+{ return size <= POOL_SLAB_SIZE / 2; }
+
+static inline u32 *psh__pool_slab(Pool *pool, void *ptr)
+{ return &pool->slabs[((byte *)ptr - pool->arena.base_ptr) / POOL_SLAB_SIZE]; }
+
+static inline usize psh__pool_block_size(u32 slab)
+{ return slab & POOL_RUN ? (usize)(slab & ~POOL_RUN) * POOL_SLAB_SIZE : (usize)1 << slab; }
+
+Pool pool_init_opt(ArenaOpt arena_opt) {
+    if (arena_opt.reserve_size == 0) arena_opt.reserve_size = POOL_RESERVE_SIZE;
+    Pool pool = { .arena = arena_init_opt(arena_opt) };
+    usize slabs = pool.arena.reserved_size / POOL_SLAB_SIZE;
+    pool.slabs = arena_push(&pool.arena, u32, slabs);
+    pool.id = __atomic_fetch_add(&psh__pool_next_id, 1, __ATOMIC_RELAXED);
+    return pool;
+}
+
+// A zero initialized pool is set up by whichever thread uses it first
+static void psh__pool_setup(Pool *pool) {
+    psh__spin_lock(&pool->lock);
+    if (pool->slabs == NULL) {
+        Pool fresh = pool_init_opt((ArenaOpt) {0});
+        pool->arena = fresh.arena;
+        pool->slabs = fresh.slabs;
+        __atomic_store_n(&pool->id, fresh.id, __ATOMIC_RELEASE);
+    }
+    psh__spin_unlock(&pool->lock);
+}
+
+// Called with the lock held
+static void *psh__pool_take(Pool *pool, isize class) {
+    PoolBlock *block = pool->free[class];
+    if (block) {
+        pool->free[class] = block->next;
+        return block;
+    }
+
+    usize size = (usize)1 << class;
+    if (pool->carve[class] == pool->carve_end[class]) {
+        byte *slab = arena_push_(&pool->arena, POOL_SLAB_SIZE, POOL_SLAB_SIZE, 1);
+        if (slab == NULL) return NULL;
+
+        *psh__pool_slab(pool, slab) = class;
+        pool->carve[class] = slab;
+        pool->carve_end[class] = slab + POOL_SLAB_SIZE;
+    }
+
+    byte *memory = pool->carve[class];
+    pool->carve[class] += size;
+    return memory;
+}
+
+// Called with the lock held
+static void psh__pool_put_run(Pool *pool, byte *memory, usize slabs) {
+    PoolRun *run = (PoolRun *)memory;
+    usize list = MIN(slabs, POOL_RUN_LISTS - 1);
+    run->next = pool->runs[list];
+    run->slabs = slabs;
+    pool->runs[list] = run;
+}
+
+// Called with the lock held. Takes the shortest free run that is long
+// enough and puts back what is left of it.
+static void *psh__pool_take_run(Pool *pool, usize slabs) {
+    for (usize list = MIN(slabs, POOL_RUN_LISTS - 1); list < POOL_RUN_LISTS; ++list) {
+        for (PoolRun **link = &pool->runs[list]; *link; link = &(*link)->next) {
+            PoolRun *run = *link;
+            if (run->slabs < slabs) continue;
+
+            *link = run->next;
+            if (run->slabs > slabs) {
+                psh__pool_put_run(pool, (byte *)run + slabs * POOL_SLAB_SIZE, run->slabs - slabs);
+            }
+            *psh__pool_slab(pool, run) = POOL_RUN | slabs;
+            return run;
+        }
+    }
+
+    byte *memory = arena_push_(&pool->arena, slabs * POOL_SLAB_SIZE, POOL_SLAB_SIZE, 1);
+    if (memory == NULL) return NULL;
+
+    *psh__pool_slab(pool, memory) = POOL_RUN | slabs;
+    return memory;
+}
+
+// Called with the lock held
+static void psh__pool_give_run(Pool *pool, byte *memory, usize slabs) {
+    usize size = slabs * POOL_SLAB_SIZE;
+    b32 last = memory + size == pool->arena.base_ptr + pool->arena.current_offset;
+
+    if (slabs > POOL_RETURN_SLABS) {
+        // a run on a free list keeps the page with its header
+        usize keep = last ? 0 : pool->arena.page_size;
+        if (size > keep) madvise(memory + keep, size - keep, MADV_DONTNEED);
+    }
+
+    if (last) arena_pop(&pool->arena, size);
+    else psh__pool_put_run(pool, memory, slabs);
+}
+
+static Psh__PoolCache *psh__pool_cache(Pool *pool) {
+    Psh__PoolCache *empty = NULL;
+    for (usize i = 0; i < POOL_THREAD_CACHES; ++i) {
+        Psh__PoolCache *cache = &psh__pool_caches[i];
+        if (cache->pool == pool) {
+            if (cache->id == pool->id) return cache;
+            // left from a destroyed pool that lived at the same address
+            *cache = (Psh__PoolCache) {0};
+        }
+        if (!empty && cache->pool == NULL) empty = cache;
+    }
+    if (empty) {
+        empty->pool = pool;
+        empty->id = pool->id;
+    }
+    return empty;
+}
+
+void *pool_alloc(Pool *pool, usize size) {
+    if (__atomic_load_n(&pool->id, __ATOMIC_ACQUIRE) == 0) psh__pool_setup(pool);
+
+    if (!psh__pool_is_small(size)) {
+        if (size > pool->arena.reserved_size) return NULL;
+        psh__spin_lock(&pool->lock);
+        void *memory = psh__pool_take_run(pool, (size + POOL_SLAB_SIZE - 1) / POOL_SLAB_SIZE);
+        psh__spin_unlock(&pool->lock);
+        return memory;
+    }
+
+    isize class = psh__pool_class(size);
+    Psh__PoolCache *cache = pool->thread_cache ? psh__pool_cache(pool) : NULL;
+
+    if (cache == NULL) {
+        psh__spin_lock(&pool->lock);
+        void *memory = psh__pool_take(pool, class);
+        psh__spin_unlock(&pool->lock);
+        return memory;
+    }
+
+    if (cache->free[class] == NULL) {
+        psh__spin_lock(&pool->lock);
+        for (u32 i = 0; i < POOL_CACHE_BLOCKS / 2; ++i) {
+            PoolBlock *block = psh__pool_take(pool, class);
+            if (block == NULL) break;
+            block->next = cache->free[class];
+            cache->free[class] = block;
+            cache->count[class]++;
+        }
+        psh__spin_unlock(&pool->lock);
+        if (cache->free[class] == NULL) return NULL;
+    }
+
+    PoolBlock *block = cache->free[class];
+    cache->free[class] = block->next;
+    cache->count[class]--;
+    return block;
+}
+
+void pool_free(Pool *pool, void *ptr) {
+    if (ptr == NULL) return;
+
+    u32 slab = *psh__pool_slab(pool, ptr);
+    if (slab & POOL_RUN) {
+        psh__spin_lock(&pool->lock);
+        psh__pool_give_run(pool, ptr, slab & ~POOL_RUN);
+        psh__spin_unlock(&pool->lock);
+        return;
+    }
+
+    isize class = slab;
+    PoolBlock *block = ptr;
+    Psh__PoolCache *cache = pool->thread_cache ? psh__pool_cache(pool) : NULL;
+
+    if (cache == NULL) {
+        psh__spin_lock(&pool->lock);
+        block->next = pool->free[class];
+        pool->free[class] = block;
+        psh__spin_unlock(&pool->lock);
+        return;
+    }
+
+    block->next = cache->free[class];
+    cache->free[class] = block;
+    if (++cache->count[class] < POOL_CACHE_BLOCKS) return;
+
+    // Give half back so blocks freed by one thread reach the others
+    psh__spin_lock(&pool->lock);
+    while (cache->count[class] > POOL_CACHE_BLOCKS / 2) {
+        block = cache->free[class];
+        cache->free[class] = block->next;
+        cache->count[class]--;
+        block->next = pool->free[class];
+        pool->free[class] = block;
+    }
+    psh__spin_unlock(&pool->lock);
+}
+
+void *pool_realloc(Pool *pool, void *ptr, usize size) {
+    if (ptr == NULL) return pool_alloc(pool, size);
+
+    u32 slab = *psh__pool_slab(pool, ptr);
+    usize block_size = psh__pool_block_size(slab);
+    if (size <= block_size) return ptr;
+
+    // A run that ends the arena grows over the slabs after it
+    if ((slab & POOL_RUN) && size <= pool->arena.reserved_size) {
+        usize slabs = (size + POOL_SLAB_SIZE - 1) / POOL_SLAB_SIZE;
+        psh__spin_lock(&pool->lock);
+        b32 grown = (byte *)ptr + block_size == pool->arena.base_ptr + pool->arena.current_offset
+            && arena_push_(&pool->arena, slabs * POOL_SLAB_SIZE - block_size, 1, 1) != NULL;
+        if (grown) *psh__pool_slab(pool, ptr) = POOL_RUN | slabs;
+        psh__spin_unlock(&pool->lock);
+        if (grown) return ptr;
+    }
+
+    void *memory = pool_alloc(pool, size);
+    if (memory == NULL) return NULL;
+
+    memcpy(memory, ptr, block_size);
+    pool_free(pool, ptr);
+    return memory;
+}
+
+void pool_thread_flush(Pool *pool) {
+    for (usize i = 0; i < POOL_THREAD_CACHES; ++i) {
+        Psh__PoolCache *cache = &psh__pool_caches[i];
+        if (cache->pool != pool) continue;
+
+        if (cache->id == pool->id) {
+            psh__spin_lock(&pool->lock);
+            for (isize class = 0; class < POOL_CLASSES; ++class) {
+                while (cache->free[class]) {
+                    PoolBlock *block = cache->free[class];
+                    cache->free[class] = block->next;
+                    block->next = pool->free[class];
+                    pool->free[class] = block;
+                }
+            }
+            psh__spin_unlock(&pool->lock);
+        }
+        *cache = (Psh__PoolCache) {0};
+    }
+}
+
+// Flushes the calling thread's cache, the others are dropped
+// through the pool id, see pool START
+void pool_destroy(Pool *pool) {
+    pool_thread_flush(pool);
+    if (pool->arena.base_ptr) arena_destroy(pool->arena);
+    *pool = (Pool) { .thread_cache = pool->thread_cache };
+}
+// pool IMPL END
+
 // unity build IMPL START
 
 static inline psh_ternary psh__needs_rebuild(byte *executable, byte *src[], usize src_count);
@@ -1597,22 +4770,47 @@ u8 psh_unicode_width(Psh_Unicode ch) {
 #define list_foreach            psh_list_foreach
 #define list_resize             psh_list_resize
 #define list_clear              psh_list_clear
+#define list_arena_reserve      psh_list_arena_reserve
+#define list_arena_append       psh_list_arena_append
+#define list_arena_append_many  psh_list_arena_append_many
+#define list_arena_resize       psh_list_arena_resize
 #define list_last               psh_list_last
 #define list_pop                psh_list_pop
 #define list_remove_unordered   psh_list_remove_unordered
+#define SegList                 Psh_SegList
+#define seg_list_def            psh_seg_list_def
+#define seg_list_at             psh_seg_list_at
+#define seg_list_append         psh_seg_list_append
+#define seg_list_foreach        psh_seg_list_foreach
+#define seg_list_clear          psh_seg_list_clear
+#define seg_list_free           psh_seg_list_free
 
 #define HashMap                     Psh_HashMap
 #define HashMapEntry                Psh_HashMapEntry
+#define hash_map_occupied           psh_hash_map_occupied
+#define hash_map_finish_resize      psh_hash_map_finish_resize
 #define hash_map_def                psh_hash_map_def
 #define hash_map_init_with_memory   psh_hash_map_init_with_memory
+#define hash_map_init_with_arena    psh_hash_map_init_with_arena
 #define hash_map_resize             psh_hash_map_resize
 #define hash_map_insert             psh_hash_map_insert
 #define hash_map_get                psh_hash_map_get
+#define hash_map_get_many           psh_hash_map_get_many
 #define hash_map_remove             psh_hash_map_remove
 #define hash_map_clear              psh_hash_map_clear
 #define hash_map_free               psh_hash_map_free
+#define hash_map_save               psh_hash_map_save
+#define hash_map_open               psh_hash_map_open
 #define hash_bytes                  psh_hash_bytes
 
+#define ShardedHashMap              Psh_ShardedHashMap
+#define sharded_hash_map_def        psh_sharded_hash_map_def
+#define sharded_hash_map_init       psh_sharded_hash_map_init
+#define sharded_hash_map_insert     psh_sharded_hash_map_insert
+#define sharded_hash_map_get        psh_sharded_hash_map_get
+#define sharded_hash_map_remove     psh_sharded_hash_map_remove
+#define sharded_hash_map_free       psh_sharded_hash_map_free
+
 #define slice_def               psh_slice_def
 
 #define return_defer            psh_return_defer
@@ -1642,13 +4840,24 @@ typedef Psh_Fd                  Fd;
 #define fd_close                psh_fd_close
 #define fd_close_safe           psh_fd_close_safe
 #define fd_not_default          psh_fd_not_default
+#define file_map                psh_file_map
+#define file_unmap              psh_file_unmap
 
 typedef Psh_Cmd                 Cmd;
 typedef Psh_Cmd_Opt             Cmd_Opt;
+typedef Psh_Spawn_Backend       Spawn_Backend;
+#define SPAWN_DEFAULT           PSH_SPAWN_DEFAULT
+#define SPAWN_FORK              PSH_SPAWN_FORK
+#define SPAWN_POSIX             PSH_SPAWN_POSIX
 #define cmd_append              psh_cmd_append
 #define cmd_run                 psh_cmd_run
 #define cmd_run_opt             psh_cmd_run_opt
 #define procs_block             psh_procs_block
+#define procs_reset             psh_procs_reset
+#define procs_free              psh_procs_free
+typedef Psh_Proc_Status         Proc_Status;
+#define procs_wait_any          psh_procs_wait_any
+#define proc_status_ok          psh_proc_status_ok
 
 typedef Psh_Pipeline_Opt        Pipeline_Opt;
 typedef Psh_Pipeline            Pipeline;
@@ -1657,13 +4866,44 @@ typedef Psh_Pipeline            Pipeline;
 #define pipeline_end            psh_pipeline_end
 #define pipeline                psh_pipeline
 
+typedef Psh_Job                 Job;
+#define INVALID_JOB             PSH_INVALID_JOB
+typedef Psh_Job_State           Job_State;
+typedef Psh_Job_Node            Job_Node;
+typedef Psh_Graph_Opt           Graph_Opt;
+typedef Psh_Graph               Graph;
+#define graph_add               psh_graph_add
+#define graph_add_opt           psh_graph_add_opt
+#define graph_depend            psh_graph_depend
+#define graph_run               psh_graph_run
+#define graph_run_opt           psh_graph_run_opt
+#define graph_free              psh_graph_free
+
 #define pipe_open               psh_pipe_open
+#define pipe_open_opt           psh_pipe_open_opt
+typedef Psh_Pipe_Opt            Pipe_Opt;
 typedef Psh_Unix_Pipe           Unix_Pipe;
 #define fd_read                 psh_fd_read
 #define fd_read_opt             psh_fd_read_opt
 typedef Psh_Fd_Reader           Fd_Reader;
 typedef Psh_Fd_Reader_Opt       Fd_Reader_Opt;
+typedef Psh_Fd_Writer           Fd_Writer;
+typedef Psh_Fd_Writer_Opt       Fd_Writer_Opt;
+typedef Psh_File_Map_Opt        File_Map_Opt;
+typedef Psh_Fd_Reader_Callback  Fd_Reader_Callback;
 #define fd_readers_join         psh_fd_readers_join
+#define fd_join                 psh_fd_join
+#define fd_writer_push          psh_fd_writer_push
+#define fd_writer_push_sb       psh_fd_writer_push_sb
+#define fd_write                psh_fd_write
+typedef Psh_Reactor             Reactor;
+#define reactor_init            psh_reactor_init
+#define reactor_init_opt        psh_reactor_init_opt
+typedef Psh_Reactor_Opt         Reactor_Opt;
+#define reactor_add             psh_reactor_add
+#define reactor_poll            psh_reactor_poll
+#define reactor_join            psh_reactor_join
+#define reactor_close           psh_reactor_close
 
 typedef Psh_String_Builder      String_Builder;
 typedef Psh_Sb                  Sb;